@@ -0,0 +1,141 @@
+/*
+ * Hash
+ *
+ * Copyright (C) 2024 Andre Naef
+ */
+
+
+#include "hash.h"
+#include <string.h>
+
+
+#define HASH_PRIME1  11400714785074694791U
+#define HASH_PRIME2  14029467366897019727U
+#define HASH_PRIME3  1609587929392839161U
+#define HASH_PRIME4  9650029242287828579U
+#define HASH_PRIME5  2870177450012600261U
+
+
+static uint64_t hash_rotl(uint64_t x, int r);
+static uint64_t hash_read64(const uint8_t *p);
+static uint32_t hash_read32(const uint8_t *p);
+static uint64_t hash_round(uint64_t acc, uint64_t input);
+static uint64_t hash_merge(uint64_t acc, uint64_t v);
+
+
+/* XXH64; source: https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md */
+
+void hash_init (hash_t *h, uint64_t seed) {
+	h->v[0] = seed + HASH_PRIME1 + HASH_PRIME2;
+	h->v[1] = seed + HASH_PRIME2;
+	h->v[2] = seed;
+	h->v[3] = seed - HASH_PRIME1;
+	h->total = 0;
+	h->len = 0;
+}
+
+void hash_update (hash_t *h, const void *data, size_t len) {
+	size_t          n;
+	const uint8_t  *p, *end;
+
+	p = data;
+	end = p + len;
+	h->total += len;
+
+	/* complete pending stripe */
+	if (h->len > 0) {
+		n = sizeof(h->buf) - h->len;
+		if (len < n) {
+			memcpy(h->buf + h->len, p, len);
+			h->len += len;
+			return;
+		}
+		memcpy(h->buf + h->len, p, n);
+		p += n;
+		h->v[0] = hash_round(h->v[0], hash_read64(h->buf));
+		h->v[1] = hash_round(h->v[1], hash_read64(h->buf + 8));
+		h->v[2] = hash_round(h->v[2], hash_read64(h->buf + 16));
+		h->v[3] = hash_round(h->v[3], hash_read64(h->buf + 24));
+		h->len = 0;
+	}
+
+	/* process full stripes */
+	while (end - p >= 32) {
+		h->v[0] = hash_round(h->v[0], hash_read64(p));
+		h->v[1] = hash_round(h->v[1], hash_read64(p + 8));
+		h->v[2] = hash_round(h->v[2], hash_read64(p + 16));
+		h->v[3] = hash_round(h->v[3], hash_read64(p + 24));
+		p += 32;
+	}
+
+	/* keep remainder */
+	if (p < end) {
+		memcpy(h->buf, p, end - p);
+		h->len = end - p;
+	}
+}
+
+uint64_t hash_final (hash_t *h) {
+	uint64_t        acc;
+	const uint8_t  *p, *end;
+
+	if (h->total >= 32) {
+		acc = hash_rotl(h->v[0], 1) + hash_rotl(h->v[1], 7) + hash_rotl(h->v[2], 12)
+				+ hash_rotl(h->v[3], 18);
+		acc = hash_merge(acc, h->v[0]);
+		acc = hash_merge(acc, h->v[1]);
+		acc = hash_merge(acc, h->v[2]);
+		acc = hash_merge(acc, h->v[3]);
+	} else {
+		acc = h->v[2] + HASH_PRIME5;
+	}
+	acc += h->total;
+	p = h->buf;
+	end = p + h->len;
+	while (end - p >= 8) {
+		acc ^= hash_round(0, hash_read64(p));
+		acc = hash_rotl(acc, 27) * HASH_PRIME1 + HASH_PRIME4;
+		p += 8;
+	}
+	if (end - p >= 4) {
+		acc ^= hash_read32(p) * HASH_PRIME1;
+		acc = hash_rotl(acc, 23) * HASH_PRIME2 + HASH_PRIME3;
+		p += 4;
+	}
+	while (p < end) {
+		acc ^= *p * HASH_PRIME5;
+		acc = hash_rotl(acc, 11) * HASH_PRIME1;
+		p++;
+	}
+	acc ^= acc >> 33;
+	acc *= HASH_PRIME2;
+	acc ^= acc >> 29;
+	acc *= HASH_PRIME3;
+	acc ^= acc >> 32;
+	return acc;
+}
+
+static uint64_t hash_rotl (uint64_t x, int r) {
+	return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t hash_read64 (const uint8_t *p) {
+	return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24
+			| (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 | (uint64_t)p[6] << 48
+			| (uint64_t)p[7] << 56;
+}
+
+static uint32_t hash_read32 (const uint8_t *p) {
+	return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t hash_round (uint64_t acc, uint64_t input) {
+	acc += input * HASH_PRIME2;
+	acc = hash_rotl(acc, 31);
+	return acc * HASH_PRIME1;
+}
+
+static uint64_t hash_merge (uint64_t acc, uint64_t v) {
+	acc ^= hash_round(0, v);
+	return acc * HASH_PRIME1 + HASH_PRIME4;
+}
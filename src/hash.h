@@ -0,0 +1,31 @@
+/*
+ * Hash
+ *
+ * Copyright (C) 2024 Andre Naef
+ */
+
+
+#ifndef _HASH_INCLUDED
+#define _HASH_INCLUDED
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+typedef struct hash_s hash_t;
+
+struct hash_s {
+	uint64_t  v[4];      /* accumulators */
+	uint64_t  total;     /* total length */
+	uint8_t   buf[32];   /* pending input */
+	size_t    len;       /* pending input length */
+};
+
+
+void hash_init(hash_t *h, uint64_t seed);
+void hash_update(hash_t *h, const void *data, size_t len);
+uint64_t hash_final(hash_t *h);
+
+
+#endif /* _HASH_INCLUDED */
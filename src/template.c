@@ -8,37 +8,92 @@
 #include "template.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdio_ext.h>
 #include <ctype.h>
+#include <errno.h>
+#include <limits.h>
 #include <string.h>
+#include <math.h>
+#include <inttypes.h>
+#include <time.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <lauxlib.h>
 #include "table.h"
 #include "list.h"
+#include "hash.h"
 
 
 #define TEMPLATE_EOPEN      1     /* opening element */
 #define TEMPLATE_ECLOSE     2     /* closing element */
 
+#define TEMPLATE_TLEFT      1     /* trim whitespace preceding element or substitution */
+#define TEMPLATE_TRIGHT     2     /* trim whitespace following element or substitution */
+
 #define TEMPLATE_FESC       0xff  /* escape mask */
 #define TEMPLATE_FESCXML    1     /* 'x'; flag to escape XML/HTML characters */
 #define TEMPLATE_FESCURL    2     /* 'u'; flag to escape URL characters */
 #define TEMPLATE_FESCJS     3     /* 'j'; flag to escape JavaScript string characters */
+#define TEMPLATE_FESCCSS    4     /* 'c'; flag to escape CSS characters */
+#define TEMPLATE_FESCATTR   5     /* 'a'; flag to escape HTML attribute characters strictly */
+#define TEMPLATE_FESCCSV    6     /* 'v'; flag to quote CSV fields */
+#define TEMPLATE_FESCJSON   7     /* 's'; flag to escape JSON string characters */
 #define TEMPLATE_FSUPNIL    256   /* 'n'; flag to suppress nil values */
+#define TEMPLATE_FJSON      512   /* 'J'; flag to serialize values to JSON */
+#define TEMPLATE_FFMTINT    1024  /* number format expects an integer */
+#define TEMPLATE_FMESSAGE   2048  /* 't'; flag to substitute the catalog message of a key */
+
+#define TEMPLATE_VREAD      1     /* global name is read */
+#define TEMPLATE_VWRITE     2     /* global name is assigned */
 
 #define TEMPLATE_MAX_STACK  1024  /* maximum expression length allocated on stack */
 #define TEMPLATE_MAX_DEPTH  8     /* maximum template inclusion depth */
+#define TEMPLATE_MAX_VALUE  64    /* maximum formatted number or type placeholder length */
+#define TEMPLATE_MAX_JSON   32    /* maximum JSON nesting depth */
+#define TEMPLATE_MAX_FORMAT 512   /* maximum formatted number length */
+#define TEMPLATE_MAX_CACHED 256   /* maximum length of strings in the escape cache */
+#define TEMPLATE_MAX_EXPANSION 6  /* maximum length of an escaped character */
+#define TEMPLATE_MAX_SLOTS  65536 /* maximum escape cache slots per escape */
+#define TEMPLATE_NESC       7     /* number of escapes */
+#define TEMPLATE_ROPE_CHUNK 8192  /* rope arena chunk size */
+#define TEMPLATE_ROPE_REF   64    /* minimum length of raw content referenced from a rope */
+#define TEMPLATE_RAW_BUFFER 8192  /* raw include copy buffer size */
+#define TEMPLATE_DEADLINE_TICKS 64  /* nodes rendered between deadline checks */
+#define TEMPLATE_TAR_BLOCK  512   /* tar block size */
+#define TEMPLATE_MAX_NAME   4096  /* maximum tar member name length, including terminator */
+#define TEMPLATE_MAX_PARAMS 16    /* maximum function parameters excluded from expression names */
 
 
 typedef struct template_s template_t;
 typedef struct parser_s parser_t;
 typedef struct node_s node_t;
+typedef struct subopts_s subopts_t;
 typedef struct block_s block_t;
 typedef struct memstream_s memstream_t;
+typedef struct render_s render_t;
+typedef struct cache_s cache_t;
+typedef struct cache_entry_s cache_entry_t;
+typedef struct rope_s rope_t;
+typedef struct dataset_s dataset_t;
+typedef struct column_s column_t;
+typedef struct row_s row_t;
+typedef struct archive_s archive_t;
+typedef struct member_s member_t;
+typedef struct catalog_s catalog_t;
+typedef struct message_s message_t;
 
 struct template_s {
-	char        *str;    /* template contents */
-	list_t      *nodes;  /* list of template nodes */
-	const void  *env;    /* environment */
+	char        *str;       /* template contents */
+	list_t      *nodes;     /* list of template nodes */
+	list_t      *includes;  /* literal include file names */
+	int          computed;  /* has includes with computed file names */
+	table_t     *names;     /* global names read and assigned, by variable flags */
+	size_t       env_size;  /* names of the template and its literal includes; 0 if unknown */
+	const void  *env;       /* environment */
 };
 
 struct parser_s {
@@ -48,9 +103,16 @@ struct parser_s {
 	char        *begin;     /* begin of raw content */
 	char        *pos;       /* parsing position */
 	int          element;   /* current element flags */
+	int          trim;      /* current trim flags */
 	table_t     *attrs;     /* current element attributes */
 	list_t      *nodes;     /* list of template nodes */
 	list_t      *blocks;    /* block stack (if, for) */
+	int          minify;    /* minify whitespace in raw content */
+	int          tag;       /* raw content follows a tag */
+	const char  *preserve;  /* open element preserving whitespace, if any */
+	list_t      *includes;  /* literal include file names */
+	int          computed;  /* has includes with computed file names */
+	table_t     *names;     /* global names read and assigned, by variable flags */
 };
 
 typedef enum {
@@ -61,45 +123,60 @@ typedef enum {
 	NT_FOR_NEXT,
 	NT_SET,
 	NT_INCLUDE,
+	NT_RAWINCLUDE,
+	NT_FLUSH,
 	NT_SUB,
 	NT_RAW,
 } node_type_e;
 
 struct node_s {
-	node_type_e      type;            /* node type */
+	node_type_e      type;                /* node type */
 	union {
 		struct {
-			off_t    jump_next;       /* node index to jump to */
+			off_t       jump_next;        /* node index to jump to */
 		};
 		struct {
-			int      if_ref;          /* condition expression reference */
-			off_t    if_next;         /* node index to jump to if condition is false */
+			int         if_ref;           /* condition expression reference */
+			off_t       if_next;          /* node index to jump to if condition is false */
 		};
 		struct {
-			int      for_init_ref;    /* init expression reference */
+			int         for_init_ref;     /* init expression reference */
 		};
 		struct {
-			list_t  *for_next_names;  /* list of names */
-			off_t    for_next_next;   /* node index to jump to when iteration ends */
+			list_t     *for_next_names;   /* list of names */
+			off_t       for_next_next;    /* node index to jump to when iteration ends */
 		};
 		struct {
-			list_t  *set_names;       /* list of names*/
-			int      set_ref;         /* set expression reference */
+			list_t     *set_names;        /* list of names*/
+			int         set_ref;          /* set expression reference */
 		};
 		struct {
-			int      include_ref;     /* include filename reference */
+			int         include_ref;      /* include filename reference */
+			int         include_esi;      /* include is edge-cacheable */
 		};
 		struct {
-			int      sub_ref;         /* substitution expression reference */
-			int      sub_flags;       /* substitution flags */
+			int         rawinclude_ref;   /* raw include filename reference */
 		};
 		struct {
-			char    *raw_str;         /* raw string */
-			size_t   raw_len;         /* raw length */
+			int         sub_ref;          /* substitution expression reference */
+			int         sub_flags;        /* substitution flags */
+			subopts_t  *sub_opts;         /* substitution options; NULL if none */
+		};
+		struct {
+			char       *raw_str;          /* raw string */
+			size_t      raw_len;          /* raw length */
 		};
 	};
 };
 
+struct subopts_s {
+	char        *format;          /* number format; NULL if none */
+	char        *join;            /* array separator; NULL if none */
+	size_t       join_len;        /* array separator length */
+	message_t  **messages;        /* escaped messages by locale index; NULL if unresolved */
+	size_t       messages_count;  /* number of locale indices */
+};
+
 struct block_s {
 	node_type_e     type;       /* block type (NT_IF, NT_FOR_NEXT) */
 	union {
@@ -120,6 +197,109 @@ struct memstream_s {
 	size_t       len;     /* size of buffer */ 
 };
 
+struct render_s {
+	lua_State  *L;            /* Lua state */
+	FILE       *f;            /* output stream */
+	int         hashing;      /* hash output */
+	hash_t      hash;         /* output hash state */
+	int         flushing;     /* flush output at flush points */
+	size_t      written;      /* bytes written */
+	size_t      flush_after;  /* flush once after this many bytes; 0 if none */
+	size_t      max_bytes;    /* maximum bytes to write; 0 if unlimited */
+	uint64_t    deadline;     /* monotonic deadline in milliseconds; 0 if none */
+	unsigned    ticks;        /* nodes rendered, for deadline checks */
+	off_t       start;        /* file handle offset when rendering started; -1 if unknown */
+	int         truncate;     /* truncate to start on a limit; start was at the end of file */
+	int         tracking;     /* track the keys read by top-level blocks */
+	memstream_t *patching;    /* memory stream when rendering patches; NULL otherwise */
+	int         esi;          /* emit edge-side include tags for edge-cacheable includes */
+	int         templates;    /* stack index of the templates registry */
+	int         escapes;      /* stack index of the escape cache, or nil */
+	int         deps;         /* stack index of the tracked dependencies, or nil */
+	int         changed;      /* stack index of the changed key set, or nil */
+	int         esi_option;   /* stack index of the edge-side include option */
+	int         patches;      /* stack index of the patches; 0 if not rendering patches */
+	cache_t    *cache;        /* escape cache; NULL if disabled */
+	catalog_t  *catalog;      /* message catalog of the locale; NULL if none */
+	rope_t     *rope;         /* output rope; NULL if writing to a file */
+	char       *capture;      /* capture buffer; NULL if not capturing */
+	size_t      capture_len;  /* captured length */
+	luaL_Buffer *buffer;      /* Lua buffer collecting the output; NULL if none */
+};
+
+typedef enum {
+	DT_NONE,
+	DT_INTEGER,
+	DT_FLOAT,
+	DT_STRING
+} data_type_e;
+
+struct dataset_s {
+	size_t     rows;     /* number of rows */
+	size_t     count;    /* number of columns */
+	column_t  *columns;  /* columns */
+};
+
+struct column_s {
+	data_type_e     type;      /* column type */
+	const char     *name;      /* column name, anchored by the dataset */
+	size_t          name_len;  /* column name length */
+	unsigned char  *nils;      /* nil flags by row */
+	lua_Integer    *integers;  /* integer values */
+	lua_Number     *floats;    /* float values */
+	size_t         *offsets;   /* string offsets into data by row, plus end offset */
+	char           *data;      /* string data */
+};
+
+struct row_s {
+	size_t      row;     /* current row */
+	size_t      column;  /* column of the last lookup; count if none */
+	dataset_t  *ds;      /* dataset */
+};
+
+struct archive_s {
+	char     *map;      /* mapped archive; NULL if none */
+	size_t    size;     /* mapped size */
+	table_t  *members;  /* members by name, member_t */
+};
+
+struct member_s {
+	const char  *str;  /* member contents in the mapped archive */
+	size_t       len;  /* member length */
+};
+
+struct catalog_s {
+	size_t    index;     /* locale index */
+	table_t  *messages;  /* messages by key, message_t */
+};
+
+struct message_s {
+	size_t  len;    /* message length */
+	char    str[];  /* message */
+};
+
+struct rope_s {
+	list_t  *slices;  /* slices, struct iovec */
+	list_t  *chunks;  /* arena chunks */
+	char    *pos;     /* free position in the current chunk */
+	size_t   avail;   /* available bytes in the current chunk */
+	int      arena;   /* last slice ends at the free position */
+	size_t   len;     /* total length */
+};
+
+struct cache_s {
+	size_t          slots;    /* slots per escape */
+	int             bits;     /* log2 of slots */
+	cache_entry_t  *entries;  /* entries, TEMPLATE_NESC * slots */
+};
+
+struct cache_entry_s {
+	const char  *str;          /* string; anchored in the user value of the cache */
+	size_t       len;          /* string length */
+	char        *escaped;      /* escaped string; NULL if the string needs no escaping */
+	size_t       escaped_len;  /* escaped string length */
+};
+
 
 /* parsing */
 static void template_unescape_xml(char *str);
@@ -127,19 +307,41 @@ static int template_error(parser_t *p, const char *msg);
 static int template_oom(parser_t *p);
 static node_t *template_append_node(parser_t *p);
 static block_t *template_append_block(parser_t *p);
-static int template_parse_flags(parser_t *p, const char *flags);
+static void template_parse_escape(parser_t *p, node_t *node, int escape);
+static void template_parse_flags(parser_t *p, node_t *node, char *flags);
+static subopts_t *template_parse_opts(parser_t *p, node_t *node);
+static void template_parse_format(parser_t *p, node_t *node, const char *format);
+static void template_parse_join(parser_t *p, node_t *node, const char *join);
 static list_t *template_parse_names(parser_t *p, char *names);
+static void template_scan_name(parser_t *p, const char *name, size_t len, int flags);
+static int template_is_keyword(const char *name, size_t len);
+static void template_scan_names(parser_t *p, const char *exp);
 static int template_parse_expression(parser_t *p, const char *exp);
 static void template_parse_if(parser_t *p);
 static void template_parse_elseif(parser_t *p);
 static void template_parse_else(parser_t *p);
 static void template_parse_for(parser_t *p);
 static void template_parse_set(parser_t *p);
+static int template_literal(const char *exp, const char **str, size_t *len);
+static void template_parse_literal(parser_t *p, const char *exp);
 static void template_parse_include(parser_t *p);
+static void template_parse_rawinclude(parser_t *p);
+static void template_parse_flush(parser_t *p);
+static void template_parse_message(parser_t *p);
+static void template_resolve_messages(parser_t *p, node_t *node, const char *exp);
 static void template_parse_element(parser_t *p);
 static void template_parse_sub(parser_t *p);
+static const char *template_minify_preserve(const char *str, const char *end);
+static void template_minify(parser_t *p, node_t *node);
 static void template_parse_raw(parser_t *p);
+static int template_is_element(const char *pos);
+static int template_is_trim_sub(const char *pos);
+static void template_parse_trim(parser_t *p);
 static void template_resolve(parser_t *p);
+static int template_source(lua_State *L, const char *filename);
+static const char *template_member(lua_State *L, const char *filename, size_t *len);
+static void template_contents(parser_t *p, const char *str, size_t len);
+static void template_resolver_call(lua_State *L, const char *filename);
 static int template_parse(lua_State *L);
 static void template_nodes_free(lua_State *L, list_t *nodes);
 static int template_parser_gc(lua_State *L);
@@ -150,20 +352,159 @@ static int template_gc(lua_State *L);
 static void template_eval(lua_State *L, int index, int nret);
 static void template_eval_str(lua_State *L, int index);
 static void template_setenv(lua_State *L, template_t *t);
-static void template_render_template(lua_State *L, FILE *f, const char *filename, int depth);
+static size_t template_format_integer(lua_Integer value, char *buf);
+static size_t template_format_number(lua_State *L, int index, char *buf);
+static void template_write(render_t *r, const char *str, size_t len);
+static void template_written(render_t *r, const char *str, size_t len);
+static void template_write_raw(render_t *r, const char *str, size_t len);
+static void template_rope_write(render_t *r, const char *str, size_t len);
+static void template_flush(render_t *r);
+static uint64_t template_clock(void);
+static void template_limit(render_t *r, const char *msg);
+static void template_check_deadline(render_t *r);
+static void template_escape(render_t *r, const char *str, size_t len, const char **escapes);
+static void template_escape_hex(render_t *r, const char *str, size_t len, const char *safe,
+		const char *prefix, const char *suffix);
+static void template_escape_csv(render_t *r, const char *str, size_t len);
+static void template_escape_json(render_t *r, const char *str, size_t len, int flags);
+static void template_output(render_t *r, const char *str, size_t len, int flags);
+static uint64_t template_cache_slot(cache_t *cache, const char *str, int escape);
+static void template_output_cached(render_t *r, int index, const char *str, size_t len,
+		int flags);
+static void template_json_string(render_t *r, const char *str, size_t len, int flags);
+static void template_json(render_t *r, int index, int flags, int depth);
+static size_t template_format_custom(lua_State *L, int index, const char *format, int flags,
+		char *buf);
+static int template_write_safe(render_t *r, int index);
+static void template_sub_value(render_t *r, int index, int flags, subopts_t *opts);
+static void template_sub(render_t *r, int index, int flags, subopts_t *opts);
+static void template_message(render_t *r, node_t *node);
+static int template_rawclose(lua_State *L);
+static void template_rawinclude(render_t *r, const char *filename);
+static void template_esi(render_t *r, const char *filename);
+static int template_track_index(lua_State *L);
+static int template_track_newindex(lua_State *L);
+static size_t template_block_end(template_t *t, size_t i);
+static int template_block_affected(render_t *r, int id);
+static void template_render_tracked(render_t *r, template_t *template);
+static void template_flush_patch(render_t *r);
+static void template_dataset_init(lua_State *L);
+static int template_dataset_next(lua_State *L, node_t *node);
+static void template_render_nodes(render_t *r, template_t *template, size_t first, size_t last,
+		int depth);
+static void template_prefetch_add(lua_State *L, int templates, const char *filename,
+		int requested, int pending);
+static void template_prefetched(lua_State *L, int templates, const char *filename,
+		int requested, int pending);
+static void template_prefetch(lua_State *L, int templates, const char *filename);
+static void template_templates(lua_State *L);
+static template_t *template_load(lua_State *L, int index, const char *filename);
+static void template_render_template(render_t *r, const char *filename, int depth);
 static int template_fclose(lua_State *L);
+static int template_render_option(lua_State *L, const char *name);
 static int template_render(lua_State *L);
 
 /* library */
 static int template_getresolver(lua_State *L);
 static int template_setresolver(lua_State *L);
+static int template_setsources(lua_State *L);
+static int template_setarchive(lua_State *L);
+static const char *template_tar_field(const unsigned char *field, size_t len, char *buf);
+static int template_tar_path(const char *data, size_t len, const char **path, size_t *path_len);
+static int template_archive_gc(lua_State *L);
+static int template_setcatalog(lua_State *L);
+static int template_catalog_gc(lua_State *L);
+static int template_getminify(lua_State *L);
+static int template_setminify(lua_State *L);
 static int template_clear(lua_State *L);
+static int template_variables(lua_State *L);
+static int template_variables_add(lua_State *L, const char *filename, int index);
+static int template_newenv(lua_State *L);
+static int template_getescapecache(lua_State *L);
+static int template_setescapecache(lua_State *L);
+static int template_cache_gc(lua_State *L);
+static int template_safe(lua_State *L);
+static void template_escape_value(lua_State *L, int index, int flags);
+static int template_escapestring(lua_State *L);
+static int template_escapeall(lua_State *L);
+static int template_safe_tostring(lua_State *L);
+static int template_dataset(lua_State *L);
+static void template_dataset_columns(lua_State *L, dataset_t *ds, size_t count);
+static void template_dataset_alloc(lua_State *L, dataset_t *ds, column_t *column,
+		size_t data_len);
+static void template_dataset_name(lua_State *L, dataset_t *ds, size_t index);
+static void template_dataset_table(lua_State *L, dataset_t *ds);
+static const char *template_dataset_field(const char **pos, const char *end, int sep,
+		size_t *len);
+static data_type_e template_dataset_type(const char *field, size_t len);
+static void template_dataset_file(lua_State *L, dataset_t *ds);
+static void template_dataset_set(dataset_t *ds, size_t index, size_t row, const char *field,
+		size_t len, char *buf);
+static int template_dataset_len(lua_State *L);
+static int template_dataset_gc(lua_State *L);
+static int template_row_index(lua_State *L);
+static int template_rope_len(lua_State *L);
+static int template_rope_tostring(lua_State *L);
+static int template_rope_totable(lua_State *L);
+static int template_rope_iovecs(lua_State *L);
+static int template_rope_gc(lua_State *L);
 
 
 static char template_hex_digits[] = {
 	'0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'A', 'B', 'C', 'D', 'E', 'F'
 };
 
+static const char template_digit_pairs[] =
+	"0001020304050607080910111213141516171819"
+	"2021222324252627282930313233343536373839"
+	"4041424344454647484950515253545556575859"
+	"6061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
+static const char *template_escapes_xml[256] = {
+	['"'] = "&quot;", ['\''] = "&apos;", ['<'] = "&lt;", ['>'] = "&gt;", ['&'] = "&amp;"
+};
+
+static const char *template_escapes_js[256] = {
+	['\b'] = "\\b", ['\t'] = "\\t", ['\n'] = "\\n", ['\v'] = "\\v", ['\f'] = "\\f",
+	['\r'] = "\\r", ['"'] = "\\\"", ['\''] = "\\'", ['\\'] = "\\\\"
+};
+
+static const char *template_escapes_csv[256] = {
+	['"'] = "\"\""
+};
+
+static const char template_safe_url[256] = {
+	['0' ... '9'] = 1, ['A' ... 'Z'] = 1, ['a' ... 'z'] = 1, ['-'] = 1, ['.'] = 1, ['_'] = 1,
+	['~'] = 1
+};
+
+static const char template_safe_css[256] = {
+	['0' ... '9'] = 1, ['A' ... 'Z'] = 1, ['a' ... 'z'] = 1, [0x80 ... 0xff] = 1
+};
+
+static const char template_safe_attr[256] = {
+	['0' ... '9'] = 1, ['A' ... 'Z'] = 1, ['a' ... 'z'] = 1, [','] = 1, ['.'] = 1, ['-'] = 1,
+	['_'] = 1, [0x80 ... 0xff] = 1
+};
+
+static const char template_special_csv[256] = {
+	[','] = 1, ['"'] = 1, ['\r'] = 1, ['\n'] = 1
+};
+
+static const char *template_preserve_elements[] = {
+	"pre", "textarea", "script", "style", NULL
+};
+
+static const char *const template_escape_letters[] = {
+	"x", "u", "j", "c", "a", "v", "s", NULL
+};
+
+static const char *template_keywords[] = {
+	"and", "break", "do", "else", "elseif", "end", "false", "for", "function", "goto", "if",
+	"in", "local", "nil", "not", "or", "repeat", "return", "then", "true", "until", "while", NULL
+};
+
 
 /*
  * parsing
@@ -256,43 +597,211 @@ static block_t *template_append_block (parser_t *p) {
 	return block;
 }
 
-static int template_parse_flags (parser_t *p, const char *flags) {
-	int          value;
-	const char  *f;
+static void template_parse_escape (parser_t *p, node_t *node, int escape) {
+	if (node->sub_flags & TEMPLATE_FESC) {
+		template_error(p, "bad flags: multiple escapes");
+	}
+	node->sub_flags |= escape;
+}
 
-	value = 0;
-	for (f = flags; *f != '\0'; f++) {
-		switch (*f) {
-		case 'x':
-			if (value & TEMPLATE_FESC) {
-				template_error(p, "bad flags: multiple escacpes");
-			}
-			value |= TEMPLATE_FESCXML;
-			break;
+static void template_parse_flags (parser_t *p, node_t *node, char *flags) {
+	int    more;
+	char  *f, *name, *value;
+
+	/* letters, unless the flags start with an option */
+	node->sub_flags = 0;
+	f = flags;
+	if (flags[strcspn(flags, ",=")] == '=') {
+		more = 1;
+	} else {
+		for (; *f != '\0' && *f != ','; f++) {
+			switch (*f) {
+			case 'x':
+				template_parse_escape(p, node, TEMPLATE_FESCXML);
+				break;
+
+			case 'u':
+				template_parse_escape(p, node, TEMPLATE_FESCURL);
+				break;
+
+			case 'j':
+				template_parse_escape(p, node, TEMPLATE_FESCJS);
+				break;
 
-		case 'u':
-			if (value & TEMPLATE_FESC) {
-				template_error(p, "bad flags: multiple escacpes");
+			case 'c':
+				template_parse_escape(p, node, TEMPLATE_FESCCSS);
+				break;
+
+			case 'a':
+				template_parse_escape(p, node, TEMPLATE_FESCATTR);
+				break;
+
+			case 'v':
+				template_parse_escape(p, node, TEMPLATE_FESCCSV);
+				break;
+
+			case 's':
+				template_parse_escape(p, node, TEMPLATE_FESCJSON);
+				break;
+
+			case 'n':
+				node->sub_flags |= TEMPLATE_FSUPNIL;
+				break;
+
+			case 'J':
+				node->sub_flags |= TEMPLATE_FJSON;
+				break;
+
+			case 't':
+				node->sub_flags |= TEMPLATE_FMESSAGE;
+				break;
+
+			default:
+				template_error(p, "bad flags: unknown character");
 			}
-			value |= TEMPLATE_FESCURL;
-			break;
+		}
+		more = *f == ',';
+		if (more) {
+			f++;
+		}
+	}
 
-		case 'j':
-			if (value & TEMPLATE_FESC) {
-				template_error(p, "bad flags: multiple escacpes");
+	/* options */
+	while (more) {
+		name = f;
+		while (*f != '=' && *f != ',' && *f != '\0') {
+			f++;
+		}
+		if (*f != '=') {
+			template_error(p, "bad flags: '=' expected");
+		}
+		*f++ = '\0';
+		if (*f == '"') {
+			value = ++f;
+			while (*f != '"' && *f != '\0') {
+				f++;
 			}
-			value |= TEMPLATE_FESCJS;
-			break;
+			if (*f != '"') {
+				template_error(p, "bad flags: '\"' expected");
+			}
+			*f++ = '\0';
+			if (*f != ',' && *f != '\0') {
+				template_error(p, "bad flags: ',' expected");
+			}
+		} else {
+			value = f;
+			while (*f != ',' && *f != '\0') {
+				f++;
+			}
+		}
+		more = *f == ',';
+		*f++ = '\0';
+		if (strcmp(name, "format") == 0) {
+			template_parse_format(p, node, value);
+		} else if (strcmp(name, "join") == 0) {
+			template_parse_join(p, node, value);
+		} else {
+			template_error(p, "bad flags: unknown option");
+		}
+	}
+	if ((node->sub_flags & TEMPLATE_FJSON) && node->sub_opts) {
+		template_error(p, "bad flags: options cannot be combined with JSON");
+	}
+	if ((node->sub_flags & TEMPLATE_FMESSAGE)
+			&& ((node->sub_flags & TEMPLATE_FJSON) || node->sub_opts)) {
+		template_error(p, "bad flags: JSON and options cannot be combined with messages");
+	}
+}
 
-		case 'n':
-			value |= TEMPLATE_FSUPNIL;
-			break;
+static subopts_t *template_parse_opts (parser_t *p, node_t *node) {
+	if (!node->sub_opts) {
+		node->sub_opts = calloc(1, sizeof(subopts_t));
+		if (!node->sub_opts) {
+			template_oom(p);
+		}
+	}
+	return node->sub_opts;
+}
 
-		default:
-			template_error(p, "bad flags: unknown character");
+static void template_parse_format (parser_t *p, node_t *node, const char *format) {
+	int          digits;
+	char        *w;
+	subopts_t   *opts;
+	const char  *f, *conv;
+
+	opts = template_parse_opts(p, node);
+	if (opts->format) {
+		template_error(p, "bad flags: multiple formats");
+	}
+
+	/* validate: literal text and exactly one numeric conversion with bounded width/precision */
+	conv = NULL;
+	for (f = format; *f != '\0'; f++) {
+		if (*f != '%') {
+			continue;
+		}
+		f++;
+		if (*f == '%') {
+			continue;
+		}
+		if (conv) {
+			template_error(p, "bad format: multiple conversions");
+		}
+		while (*f != '\0' && strchr("-+ #0", *f)) {
+			f++;
+		}
+		for (digits = 0; isdigit(*f); digits++) {
+			f++;
 		}
+		if (digits > 2) {
+			template_error(p, "bad format: width too large");
+		}
+		if (*f == '.') {
+			f++;
+			for (digits = 0; isdigit(*f); digits++) {
+				f++;
+			}
+			if (digits > 2) {
+				template_error(p, "bad format: precision too large");
+			}
+		}
+		if (*f == '\0' || !strchr("diouxXeEfFgGaA", *f)) {
+			template_error(p, "bad format: bad conversion");
+		}
+		conv = f;
+	}
+	if (!conv) {
+		template_error(p, "bad format: no conversion");
+	}
+
+	/* build the C format, adding the length modifier for integer conversions */
+	opts->format = malloc(strlen(format) + sizeof(LUA_INTEGER_FRMLEN));
+	if (!opts->format) {
+		template_oom(p);
+	}
+	w = opts->format;
+	memcpy(w, format, conv - format);
+	w += conv - format;
+	if (strchr("diouxX", *conv)) {
+		node->sub_flags |= TEMPLATE_FFMTINT;
+		memcpy(w, LUA_INTEGER_FRMLEN, sizeof(LUA_INTEGER_FRMLEN) - 1);
+		w += sizeof(LUA_INTEGER_FRMLEN) - 1;
+	}
+	strcpy(w, conv);
+}
+
+static void template_parse_join (parser_t *p, node_t *node, const char *join) {
+	subopts_t  *opts;
+
+	opts = template_parse_opts(p, node);
+	if (opts->join) {
+		template_error(p, "bad flags: multiple joins");
+	}
+	opts->join = strdup(join);
+	if (!opts->join) {
+		template_oom(p);
 	}
-	return value;
+	opts->join_len = strlen(join);
 }
 
 static list_t *template_parse_names (parser_t *p, char *names) {
@@ -312,6 +821,7 @@ static list_t *template_parse_names (parser_t *p, char *names) {
 			template_oom(p);
 		}
 		*entry = name;
+		template_scan_name(p, name, strlen(name), TEMPLATE_VWRITE);
 		name = strtok_r(NULL, "\t ,", &state);		
 	}
 	if (l->count == 0) {
@@ -321,11 +831,153 @@ static list_t *template_parse_names (parser_t *p, char *names) {
 	return l;
 }
 
+static void template_scan_name (parser_t *p, const char *name, size_t len, int flags) {
+	char  *key;
+
+	key = strndup(name, len);
+	if (!key) {
+		template_oom(p);
+	}
+	flags |= (int)(uintptr_t)table_get(p->names, key);
+	if (table_set(p->names, key, (void *)(uintptr_t)flags) != 0) {
+		free(key);
+		template_oom(p);
+	}
+	free(key);
+}
+
+static int template_is_keyword (const char *name, size_t len) {
+	const char  **k;
+
+	for (k = template_keywords; *k != NULL; k++) {
+		if (strlen(*k) == len && strncmp(name, *k, len) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void template_scan_names (parser_t *p, const char *exp) {
+	int          member, param;
+	char         quote;
+	size_t       level, nparams, depth, i;
+	const char  *c, *begin, *next, *params[TEMPLATE_MAX_PARAMS];
+	size_t       params_len[TEMPLATE_MAX_PARAMS], params_depth[TEMPLATE_MAX_PARAMS];
+
+	/* record the names an expression reads, skipping strings, comments, fields, methods,
+	   keywords, function parameters, and table constructor keys */
+	member = 0;
+	nparams = 0;
+	depth = 0;
+	c = exp;
+	while (*c != '\0') {
+		if (*c == '"' || *c == '\'') {
+			quote = *c++;
+			while (*c != quote && *c != '\0') {
+				if (*c == '\\' && c[1] != '\0') {
+					c++;
+				}
+				c++;
+			}
+			if (*c != '\0') {
+				c++;
+			}
+			member = 0;
+		} else if (*c == '-' && c[1] == '-' && (c[2] != '[' || (c[3] != '[' && c[3] != '='))) {
+			c += strcspn(c, "\n");
+		} else if ((*c == '[' && (c[1] == '[' || c[1] == '='))
+				|| (*c == '-' && c[1] == '-')) {
+			/* long string or long comment */
+			c += *c == '-' ? 3 : 1;
+			level = strspn(c, "=");
+			c += level;
+			if (*c == '[') {
+				while (*c != '\0' && !(*c == ']' && strspn(c + 1, "=") == level
+						&& c[level + 1] == ']')) {
+					c++;
+				}
+				c += *c != '\0' ? level + 2 : 0;
+			}
+			member = 0;
+		} else if (isdigit(*c) || (*c == '.' && isdigit(c[1]))) {
+			begin = c;
+			while (isalnum(*c) || *c == '.' || ((*c == '+' || *c == '-') && c > begin
+					&& strchr("eEpP", c[-1]))) {
+				c++;
+			}
+			member = 0;
+		} else if (isalpha(*c) || *c == '_') {
+			begin = c;
+			while (isalnum(*c) || *c == '_') {
+				c++;
+			}
+			if (template_is_keyword(begin, c - begin)) {
+				if (c - begin == 8 && strncmp(begin, "function", 8) == 0) {
+					/* parameters are local to the function body, up to its matching end */
+					depth++;
+					c += strcspn(c, "()");
+					while (*c != ')' && *c != '\0') {
+						c++;
+						c += strspn(c, " \t\r\n,");
+						begin = c;
+						while (isalnum(*c) || *c == '_') {
+							c++;
+						}
+						if (c > begin && nparams < TEMPLATE_MAX_PARAMS) {
+							params[nparams] = begin;
+							params_len[nparams] = c - begin;
+							params_depth[nparams++] = depth;
+						}
+						c += strcspn(c, ",)");
+					}
+				} else if ((c - begin == 2 && (strncmp(begin, "if", 2) == 0
+						|| strncmp(begin, "do", 2) == 0))) {
+					/* blocks closed by end */
+					depth++;
+				} else if (c - begin == 3 && strncmp(begin, "end", 3) == 0) {
+					if (depth > 0) {
+						depth--;
+					}
+					while (nparams > 0 && params_depth[nparams - 1] > depth) {
+						nparams--;
+					}
+				}
+			} else if (!member) {
+				param = 0;
+				for (i = 0; i < nparams && !param; i++) {
+					param = params_len[i] == (size_t)(c - begin)
+							&& strncmp(params[i], begin, c - begin) == 0;
+				}
+				next = c;
+				while (isspace(*next)) {
+					next++;
+				}
+				if (!param && (*next != '=' || next[1] == '=')) {
+					template_scan_name(p, begin, c - begin, TEMPLATE_VREAD);
+				}
+			}
+			member = 0;
+		} else if (*c == '.' && c[1] == '.') {
+			c += strspn(c, ".");
+			member = 0;
+		} else if (*c == '.' || *c == ':') {
+			c++;
+			member = 1;
+		} else {
+			if (!isspace(*c)) {
+				member = 0;
+			}
+			c++;
+		}
+	}
+}
+
 static int template_parse_expression (parser_t *p, const char *exp) {
 	int     on_stack;
 	char   *chunk;
 	size_t  len;
 
+	template_scan_names(p, exp);
 	len = strlen(exp);
 	on_stack = sizeof("return ") - 1 + len <= TEMPLATE_MAX_STACK;
 	if (on_stack) {
@@ -506,8 +1158,55 @@ static void template_parse_set (parser_t *p) {
 	node->set_ref = template_parse_expression(p, expressions);
 }
 
+static int template_literal (const char *exp, const char **str, size_t *len) {
+	char         quote;
+	const char  *begin, *end;
+
+	/* test for a string literal without escape sequences, and get its contents */
+	while (isspace(*exp)) {
+		exp++;
+	}
+	if (*exp != '\'' && *exp != '"') {
+		return 0;
+	}
+	quote = *exp++;
+	begin = exp;
+	while (*exp != quote && *exp != '\\' && *exp != '\0') {
+		exp++;
+	}
+	if (*exp != quote) {
+		return 0;
+	}
+	end = exp++;
+	while (isspace(*exp)) {
+		exp++;
+	}
+	if (*exp != '\0') {
+		return 0;
+	}
+	*str = begin;
+	*len = end - begin;
+	return 1;
+}
+
+static void template_parse_literal (parser_t *p, const char *exp) {
+	char        **entry;
+	size_t        len;
+	const char   *str;
+
+	/* record an include file name given as a string literal */
+	if (!template_literal(exp, &str, &len)) {
+		p->computed = 1;
+		return;
+	}
+	entry = list_append(p->includes);
+	if (!entry || !(*entry = strndup(str, len))) {
+		template_oom(p);
+	}
+}
+
 static void template_parse_include (parser_t *p) {
-	char    *filename;
+	char    *filename, *esi;
 	node_t  *node;
 
 	if (p->element != (TEMPLATE_EOPEN | TEMPLATE_ECLOSE)) {
@@ -516,17 +1215,131 @@ static void template_parse_include (parser_t *p) {
 	node = template_append_node(p);
 	node->type = NT_INCLUDE;
 	node->include_ref = LUA_NOREF;
+	node->include_esi = 0;
 	filename = table_get(p->attrs, "filename");
 	if (filename == NULL) {
 		template_error(p, "missing attribute 'filename'");
 	}
+	template_parse_literal(p, filename);
 	node->include_ref = template_parse_expression(p, filename);
+	esi = table_get(p->attrs, "esi");
+	if (esi != NULL) {
+		if (strcmp(esi, "true") == 0) {
+			node->include_esi = 1;
+		} else if (strcmp(esi, "false") != 0) {
+			template_error(p, "bad attribute 'esi'");
+		}
+	}
+}
+
+static void template_parse_rawinclude (parser_t *p) {
+	char    *filename;
+	node_t  *node;
+
+	if (p->element != (TEMPLATE_EOPEN | TEMPLATE_ECLOSE)) {
+		template_error(p, "'rawinclude' must be self-closing");
+	}
+	node = template_append_node(p);
+	node->type = NT_RAWINCLUDE;
+	node->rawinclude_ref = LUA_NOREF;
+	filename = table_get(p->attrs, "filename");
+	if (filename == NULL) {
+		template_error(p, "missing attribute 'filename'");
+	}
+	node->rawinclude_ref = template_parse_expression(p, filename);
+}
+
+static void template_parse_flush (parser_t *p) {
+	node_t  *node;
+
+	if (p->element != (TEMPLATE_EOPEN | TEMPLATE_ECLOSE)) {
+		template_error(p, "'flush' must be self-closing");
+	}
+	node = template_append_node(p);
+	node->type = NT_FLUSH;
+}
+
+static void template_parse_message (parser_t *p) {
+	char    *key;
+	node_t  *node;
+
+	if (p->element != (TEMPLATE_EOPEN | TEMPLATE_ECLOSE)) {
+		template_error(p, "'t' must be self-closing");
+	}
+	node = template_append_node(p);
+	node->type = NT_SUB;
+	node->sub_ref = LUA_NOREF;
+	node->sub_flags = TEMPLATE_FESCXML | TEMPLATE_FMESSAGE;
+	node->sub_opts = NULL;
+	key = table_get(p->attrs, "key");
+	if (key == NULL) {
+		template_error(p, "missing attribute 'key'");
+	}
+	node->sub_ref = template_parse_expression(p, key);
+	template_resolve_messages(p, node, key);
+}
+
+static void template_resolve_messages (parser_t *p, node_t *node, const char *exp) {
+	size_t        len, count, i;
+	render_t      r;
+	lua_State    *L;
+	subopts_t    *opts;
+	catalog_t    *catalog;
+	message_t    *message, *escaped, *shrunk;
+	const char   *key;
+
+	/* resolve a literal key in the catalog of each bound locale */
+	if (!template_literal(exp, &key, &len)) {
+		return;
+	}
+	L = p->L;
+	if (lua_getfield(L, LUA_REGISTRYINDEX, TEMPLATE_CATALOGS) != LUA_TTABLE
+			|| (count = lua_rawlen(L, -1)) == 0) {
+		lua_pop(L, 1);
+		return;
+	}
+	key = lua_pushlstring(L, key, len);
+	opts = template_parse_opts(p, node);
+	opts->messages = calloc(count, sizeof(message_t *));
+	if (!opts->messages) {
+		template_oom(p);
+	}
+	opts->messages_count = count;
+	for (i = 0; i < count; i++) {
+		lua_rawgeti(L, -2, i + 1);
+		lua_rawget(L, -3);
+		catalog = lua_touserdata(L, -1);
+		lua_pop(L, 1);
+		if (!catalog || !(message = table_get(catalog->messages, key))) {
+			continue;
+		}
+
+		/* escape the message once, as raw text for the locale */
+		escaped = malloc(sizeof(message_t) + message->len * TEMPLATE_MAX_EXPANSION + 2);
+		if (!escaped) {
+			template_oom(p);
+		}
+		opts->messages[i] = escaped;
+		memset(&r, 0, sizeof(render_t));
+		r.L = L;
+		r.capture = escaped->str;
+		template_output(&r, message->str, message->len, node->sub_flags);
+		escaped->len = r.capture_len;
+		shrunk = realloc(escaped, sizeof(message_t) + escaped->len);
+		if (shrunk) {
+			opts->messages[i] = shrunk;
+		}
+	}
+	lua_pop(L, 2);
 }
 
 static void template_parse_element (parser_t *p) {
 	char  *element, *element_end, *key, *key_end, *val, *val_end;
 
 	p->pos++;
+	if (*p->pos == '-') {
+		p->pos++;
+	}
 	if (*p->pos == '/') {
 		p->element = TEMPLATE_ECLOSE;
 		p->pos++;
@@ -535,7 +1348,8 @@ static void template_parse_element (parser_t *p) {
 	}
 	p->pos += 2;
 	element = p->pos;
-	while (!isspace(*p->pos) && *p->pos != '>' && *p->pos != '/' && *p->pos != '\0') {
+	while (!isspace(*p->pos) && *p->pos != '>' && *p->pos != '/' && *p->pos != '-'
+			&& *p->pos != '\0') {
 		p->pos++;
 	}
 	element_end = p->pos;
@@ -543,7 +1357,8 @@ static void template_parse_element (parser_t *p) {
 		p->pos++;
 	}
 	table_clear(p->attrs);
-	while (*p->pos != '>' && *p->pos != '/' && *p->pos != '\0') {
+	while (*p->pos != '>' && *p->pos != '/' && *p->pos != '\0'
+			&& !(*p->pos == '-' && (p->pos[1] == '>' || p->pos[1] == '/'))) {
 		key = p->pos;
 		while (!isspace(*p->pos) && *p->pos != '=' && *p->pos != '>' && *p->pos != '/'
 				&& *p->pos != '\0') {
@@ -585,6 +1400,10 @@ static void template_parse_element (parser_t *p) {
 			p->pos++;
 		}
 	}
+	if (*p->pos == '-') {
+		p->trim |= TEMPLATE_TRIGHT;
+		p->pos++;
+	}
 	if (*p->pos == '/') {
 		p->element |= TEMPLATE_ECLOSE;
 		p->pos++;
@@ -594,6 +1413,13 @@ static void template_parse_element (parser_t *p) {
 	}
 	p->pos++;
 	switch (element_end - element) {
+	case 1:
+		if (strncmp(element, "t", 1) == 0) {
+			template_parse_message(p);
+			return;
+		}
+		break;
+
 	case 2:
 		if (strncmp(element, "if", 2) == 0) {
 			template_parse_if(p);
@@ -618,6 +1444,13 @@ static void template_parse_element (parser_t *p) {
 		}
 		break;
 
+	case 5:
+		if (strncmp(element, "flush", 5) == 0) {
+			template_parse_flush(p);
+			return;
+		}
+		break;
+
 	case 6:
 		if (strncmp(element, "elseif", 6) == 0) {
 			template_parse_elseif(p);
@@ -631,6 +1464,13 @@ static void template_parse_element (parser_t *p) {
 			return;
 		}
 		break;
+
+	case 10:
+		if (strncmp(element, "rawinclude", 10) == 0) {
+			template_parse_rawinclude(p);
+			return;
+		}
+		break;
 	}
 	*element_end = '\0';
 	lua_pushfstring(p->L, "bad element: %s", element);
@@ -645,20 +1485,25 @@ static void template_parse_sub (parser_t *p) {
 	node = template_append_node(p);	
 	node->type = NT_SUB;
 	node->sub_ref = LUA_NOREF;
+	node->sub_opts = NULL;
 	p->pos++;
 
 	/* optional flags */
 	if (*p->pos == '[') {
 		p->pos++;
 		flags = p->pos;
-		while (*p->pos != ']' && *p->pos != '\0') {
+		quot = 0;
+		while ((*p->pos != ']' || quot) && *p->pos != '\0') {
+			if (*p->pos == '"') {
+				quot = !quot;
+			}
 			p->pos++;
 		}
 		if (*p->pos != ']') {
 			template_error(p, "']' expected");
 		}
 		*p->pos = '\0';
-		node->sub_flags = template_parse_flags(p, flags);
+		template_parse_flags(p, node, flags);
 		p->pos++;
 	} else {
 		node->sub_flags = TEMPLATE_FESCXML;
@@ -671,6 +1516,9 @@ static void template_parse_sub (parser_t *p) {
 	braces = 1;
 	quot = 0;
 	p->pos++;
+	if (*p->pos == '-' && isspace(p->pos[1])) {
+		p->pos++;  /* leading trim marker; handled by the caller */
+	}
 	expression = p->pos;
 	while (*p->pos != '\0' && braces > 0) {
 		switch (*p->pos) {
@@ -731,23 +1579,146 @@ static void template_parse_sub (parser_t *p) {
 	if (braces > 0) {
 		template_error(p, "'}' expected");
 	}
-	*(p->pos - 1) = '\0';
+	if (p->pos - 3 >= expression && *(p->pos - 2) == '-' && isspace(*(p->pos - 3))) {
+		p->trim |= TEMPLATE_TRIGHT;
+		*(p->pos - 2) = '\0';
+	} else {
+		*(p->pos - 1) = '\0';
+	}
 	template_unescape_xml(expression);
 	node->sub_ref = template_parse_expression(p, expression);
+	if (node->sub_flags & TEMPLATE_FMESSAGE) {
+		template_resolve_messages(p, node, expression);
+	}
 }
 
-static void template_parse_raw (parser_t *p) {
-	node_t  *node;
+static const char *template_minify_preserve (const char *str, const char *end) {
+	size_t        len;
+	const char  **e;
 
-	if (p->pos > p->begin) {
-		node = template_append_node(p);
-		node->type = NT_RAW;
-		node->raw_str = p->begin;
-		node->raw_len = p->pos - p->begin;
+	for (e = template_preserve_elements; *e != NULL; e++) {
+		len = strlen(*e);
+		if ((size_t)(end - str) > len && strncasecmp(str, *e, len) == 0
+				&& (isspace(str[len]) || str[len] == '>' || str[len] == '/')) {
+			return *e;
+		}
 	}
+	return NULL;
 }
 
-static void template_resolve (parser_t *p) {
+static void template_minify (parser_t *p, node_t *node) {
+	int     tag, next, newline;
+	char   *r, *w, *end;
+	size_t  len;
+
+	/* collapse whitespace runs; drop runs with a newline between tags */
+	r = w = node->raw_str;
+	end = node->raw_str + node->raw_len;
+	tag = p->tag;
+	while (r < end) {
+		if (p->preserve) {
+			/* copy verbatim up to and including the closing element name */
+			len = strlen(p->preserve);
+			while (r < end && !(*r == '<' && end - r > (ptrdiff_t)len + 1 && r[1] == '/'
+					&& strncasecmp(r + 2, p->preserve, len) == 0)) {
+				*w++ = *r++;
+			}
+			if (r < end) {
+				memmove(w, r, len + 2);
+				w += len + 2;
+				r += len + 2;
+				p->preserve = NULL;
+			}
+			tag = 0;
+		} else if (isspace(*r)) {
+			newline = 0;
+			while (r < end && isspace(*r)) {
+				if (*r == '\n' || *r == '\r') {
+					newline = 1;
+				}
+				r++;
+			}
+			next = r < end ? *r == '<' : *p->pos == '<' || *p->pos == '\0';
+			if (!newline || !tag || !next) {
+				*w++ = ' ';
+			}
+		} else {
+			if (*r == '<') {
+				p->preserve = template_minify_preserve(r + 1, end);
+			}
+			tag = *r == '>';
+			*w++ = *r++;
+		}
+	}
+	node->raw_len = w - node->raw_str;
+	p->tag = tag;
+}
+
+static void template_parse_raw (parser_t *p) {
+	char    *end;
+	node_t  *node;
+
+	end = p->pos;
+	if (p->trim & TEMPLATE_TLEFT) {
+		while (end > p->begin && isspace(*(end - 1))) {
+			end--;
+		}
+		p->trim &= ~TEMPLATE_TLEFT;
+	}
+	if (end > p->begin) {
+		node = template_append_node(p);
+		node->type = NT_RAW;
+		node->raw_str = p->begin;
+		node->raw_len = end - p->begin;
+		if (p->minify) {
+			template_minify(p, node);
+			if (node->raw_len == 0) {
+				list_pop(p->nodes);
+			}
+		}
+	}
+}
+
+static int template_is_element (const char *pos) {
+	pos++;
+	if (*pos == '-') {
+		pos++;
+	}
+	if (*pos == '/') {
+		pos++;
+	}
+	return pos[0] == 'l' && pos[1] == ':';
+}
+
+static int template_is_trim_sub (const char *pos) {
+	int  quot;
+
+	pos++;
+	if (*pos == '[') {
+		quot = 0;
+		while ((*pos != ']' || quot) && *pos != '\0') {
+			if (*pos == '"') {
+				quot = !quot;
+			}
+			pos++;
+		}
+		if (*pos == ']') {
+			pos++;
+		}
+	}
+	return pos[0] == '{' && pos[1] == '-' && isspace(pos[2]);
+}
+
+static void template_parse_trim (parser_t *p) {
+	if (p->trim & TEMPLATE_TRIGHT) {
+		while (isspace(*p->pos)) {
+			p->pos++;
+		}
+	}
+	p->trim = 0;
+}
+
+static void template_resolve (parser_t *p) {
 	FILE        *f;
 	struct stat  statbuf;
 
@@ -770,6 +1741,67 @@ static void template_resolve (parser_t *p) {
 	p->str[statbuf.st_size] = '\0';
 }
 
+static int template_source (lua_State *L, const char *filename) {
+	/* push the registered source of a template, if any */
+	if (lua_getfield(L, LUA_REGISTRYINDEX, TEMPLATE_SOURCES) != LUA_TTABLE) {
+		lua_pop(L, 1);
+		return 0;
+	}
+	if (lua_getfield(L, -1, filename) != LUA_TSTRING) {
+		lua_pop(L, 2);
+		return 0;
+	}
+	lua_remove(L, -2);
+	return 1;
+}
+
+static const char *template_member (lua_State *L, const char *filename, size_t *len) {
+	member_t   *member;
+	archive_t  *archive;
+
+	/* return the contents of an archive member, if any */
+	lua_getfield(L, LUA_REGISTRYINDEX, TEMPLATE_PACK);
+	archive = luaL_testudata(L, -1, TEMPLATE_ARCHIVE);
+	lua_pop(L, 1);
+	if (!archive || !(member = table_get(archive->members, filename))) {
+		return NULL;
+	}
+	*len = member->len;
+	return member->str;
+}
+
+static void template_contents (parser_t *p, const char *str, size_t len) {
+	/* copy, as parsing modifies the contents */
+	p->str = malloc(len + 1);
+	if (!p->str) {
+		luaL_error(p->L, "%s: out of memory", p->filename);
+	}
+	memcpy(p->str, str, len);
+	p->str[len] = '\0';
+}
+
+static void template_resolver_call (lua_State *L, const char *filename) {
+	int  batch;
+
+	/* call the resolver on the stack top; a batch resolver is called with a list of file names
+	   and returns a table of contents */
+	lua_getfield(L, LUA_REGISTRYINDEX, TEMPLATE_BATCH);
+	batch = lua_toboolean(L, -1);
+	lua_pop(L, 1);
+	if (batch) {
+		lua_createtable(L, 1, 0);
+		lua_pushstring(L, filename);
+		lua_rawseti(L, -2, 1);
+	} else {
+		lua_pushstring(L, filename);
+	}
+	lua_call(L, 1, 1);
+	if (batch && lua_istable(L, -1)) {
+		lua_getfield(L, -1, filename);
+		lua_remove(L, -2);
+	}
+}
+
 static int template_parse (lua_State *L) {
 	size_t       len;
 	parser_t    *p;
@@ -777,6 +1809,7 @@ static int template_parse (lua_State *L) {
 	const char  *str;
 
 	/* push parser */
+	lua_settop(L, 2);
 	p = lua_newuserdata(L, sizeof(parser_t));
 	memset(p, 0, sizeof(parser_t));
 	luaL_setmetatable(L, TEMPLATE_PARSER);
@@ -785,41 +1818,61 @@ static int template_parse (lua_State *L) {
 	p->attrs = table_create(4);
 	p->nodes = list_create(sizeof(node_t), 32);
 	p->blocks = list_create(sizeof(block_t), 8);
-	if (!p->attrs || !p->nodes || !p->blocks) {
+	p->includes = list_create(sizeof(char *), 4);
+	p->names = table_create(16);
+	if (!p->attrs || !p->nodes || !p->blocks || !p->includes || !p->names) {
 		return luaL_error(L, "error allocating parser");
 	}
+	list_set_free(p->includes, 1);
+	table_set_dup(p->names, 1);
 
 	/* resolve template */
-	if (lua_getfield(L, LUA_REGISTRYINDEX, TEMPLATE_RESOLVER) == LUA_TNIL) {
+	if (lua_type(L, 2) == LUA_TSTRING) {
+		/* source resolved in advance */
+		str = lua_tolstring(L, 2, &len);
+		template_contents(p, str, len);
+	} else if (template_source(L, p->filename)) {
+		/* registered source */
+		str = lua_tolstring(L, -1, &len);
+		template_contents(p, str, len);
+		lua_pop(L, 1);
+	} else if ((str = template_member(L, p->filename, &len)) != NULL) {
+		/* archive member */
+		template_contents(p, str, len);
+	} else if (lua_getfield(L, LUA_REGISTRYINDEX, TEMPLATE_RESOLVER) == LUA_TNIL) {
 		/* default file system resolver */
+		lua_pop(L, 1);
 		template_resolve(p);
 	} else {
 		/* custom resolver */
-		lua_pushvalue(L, 1);
-		lua_call(L, 1, 1);
+		template_resolver_call(L, p->filename);
 		if (!lua_isstring(L, -1)) {
 			return luaL_error(L, "%s: error resolving template", p->filename);
 		}
 		str = lua_tolstring(L, -1, &len);
-		p->str = malloc(len + 1);
-		if (!p->str) {
-			return luaL_error(L, "%s: out of memory", p->filename);
-		}
-		memcpy(p->str, str, len + 1);
+		template_contents(p, str, len);
+		lua_pop(L, 1);
 	}
+	lua_getfield(L, LUA_REGISTRYINDEX, TEMPLATE_MINIFY);
+	p->minify = lua_toboolean(L, -1);
 	lua_pop(L, 1);
 
 	/* process elements and substitution, treat all else as raw */
 	p->pos = p->str;
 	p->begin = p->pos;
+	p->tag = 1;
 	while (*p->pos != '\0') {
 		switch (*p->pos) {
 		case '<':
-			if ((p->pos[1] == 'l' && p->pos[2] == ':')
-					|| (p->pos[1] == '/' && p->pos[2] == 'l' && p->pos[3] == ':')) {
+			if (template_is_element(p->pos)) {
+				if (p->pos[1] == '-') {
+					p->trim |= TEMPLATE_TLEFT;
+				}
 				template_parse_raw(p);
 				template_parse_element(p);
+				template_parse_trim(p);
 				p->begin = p->pos;
+				p->tag = 1;
 			} else {
 				p->pos++;
 			}
@@ -829,9 +1882,14 @@ static int template_parse (lua_State *L) {
 			switch (p->pos[1]) {
 			case '{':
 			case '[':
+				if (template_is_trim_sub(p->pos)) {
+					p->trim |= TEMPLATE_TLEFT;
+				}
 				template_parse_raw(p);
 				template_parse_sub(p);
+				template_parse_trim(p);
 				p->begin = p->pos;
+				p->tag = 0;
 				break;
 
 			case '$':
@@ -864,18 +1922,24 @@ static int template_parse (lua_State *L) {
 	p->str = NULL;
 	t->nodes = p->nodes;
 	p->nodes = NULL;
+	t->includes = p->includes;
+	p->includes = NULL;
+	t->computed = p->computed;
+	t->names = p->names;
+	p->names = NULL;
 	return 1;
 };
 
 static void template_nodes_free (lua_State *L, list_t *nodes) {
 	node_t  *node;
-	size_t   i;
+	size_t   i, j;
 
 	for (i = 0; i < nodes->count; i++) {
 		node = list_get(nodes, i);
 		switch (node->type) {
 		case NT_NONE:
 		case NT_JUMP:
+		case NT_FLUSH:
 		case NT_RAW:
 			break;
 
@@ -904,8 +1968,23 @@ static void template_nodes_free (lua_State *L, list_t *nodes) {
 			luaL_unref(L, LUA_REGISTRYINDEX, node->include_ref);
 			break;
 
+		case NT_RAWINCLUDE:
+			luaL_unref(L, LUA_REGISTRYINDEX, node->rawinclude_ref);
+			break;
+
 		case NT_SUB:
 			luaL_unref(L, LUA_REGISTRYINDEX, node->sub_ref);
+			if (node->sub_opts) {
+				free(node->sub_opts->format);
+				free(node->sub_opts->join);
+				if (node->sub_opts->messages) {
+					for (j = 0; j < node->sub_opts->messages_count; j++) {
+						free(node->sub_opts->messages[j]);
+					}
+					free(node->sub_opts->messages);
+				}
+				free(node->sub_opts);
+			}
 			break;
 		}
 	}
@@ -925,6 +2004,12 @@ static int template_parser_gc (lua_State *L) {
 	if (p->blocks) {
 		list_free(p->blocks);
 	}
+	if (p->includes) {
+		list_free(p->includes);
+	}
+	if (p->names) {
+		table_free(p->names);
+	}
 	free(p->str);
 	return 0;
 }
@@ -944,6 +2029,12 @@ static int template_gc (lua_State *L) {
 	if (t->nodes) {
 		template_nodes_free(L, t->nodes);
 	}
+	if (t->includes) {
+		list_free(t->includes);
+	}
+	if (t->names) {
+		table_free(t->names);
+	}
 	free(t->str);
 	return 0;
 }
@@ -989,6 +2080,10 @@ static void template_setenv (lua_State *L, template_t *t) {
 			lua_rawgeti(L, LUA_REGISTRYINDEX, node->include_ref);
 			break;
 
+		case NT_RAWINCLUDE:
+			lua_rawgeti(L, LUA_REGISTRYINDEX, node->rawinclude_ref);
+			break;
+
 		case NT_SUB:
 			lua_rawgeti(L, LUA_REGISTRYINDEX, node->sub_ref);
 			break;
@@ -1002,315 +2097,2619 @@ static void template_setenv (lua_State *L, template_t *t) {
 	}
 }
 
-static void template_render_template (lua_State *L, FILE *f, const char *filename, int depth) {
-	int          result;
-	node_t      *node;
-	size_t       i, nret;
-	template_t  *template;
-	const char  *str, *c;
+static size_t template_format_integer (lua_Integer value, char *buf) {
+	char          digits[24], *d;
+	size_t        len;
+	lua_Unsigned  u;
+
+	/* format two digits at a time from the end */
+	d = digits + sizeof(digits);
+	u = value < 0 ? 0 - (lua_Unsigned)value : (lua_Unsigned)value;
+	while (u >= 100) {
+		d -= 2;
+		memcpy(d, &template_digit_pairs[(u % 100) * 2], 2);
+		u /= 100;
+	}
+	if (u >= 10) {
+		d -= 2;
+		memcpy(d, &template_digit_pairs[u * 2], 2);
+	} else {
+		*--d = '0' + u;
+	}
+	if (value < 0) {
+		*--d = '-';
+	}
+	len = digits + sizeof(digits) - d;
+	memcpy(buf, d, len);
+	buf[len] = '\0';
+	return len;
+}
 
-	/* check depth */
-	if (depth > TEMPLATE_MAX_DEPTH) {
-		luaL_error(L, "template depth exceeds %d", TEMPLATE_MAX_DEPTH);
+static size_t template_format_number (lua_State *L, int index, char *buf) {
+	int  len;
+
+	if (lua_isinteger(L, index)) {
+		return template_format_integer(lua_tointeger(L, index), buf);
 	}
 
-	/* get template, parsing it as needed */
-	if (lua_getfield(L, 4, filename) != LUA_TUSERDATA
-			|| !(template = luaL_testudata(L, -1, TEMPLATE_TEMPLATE))) {
-		lua_pop(L, 1);
-		lua_pushcfunction(L, template_parse);
-		lua_pushstring(L, filename);
-		lua_call(L, 1, 1);
-		lua_pushvalue(L, -1);
-		lua_setfield(L, 4, filename);
-		template = lua_touserdata(L, -1);
+	/* follow the float conversion of Lua, including the '.0' suffix for integral values */
+	len = snprintf(buf, TEMPLATE_MAX_VALUE, "%.14g", (double)lua_tonumber(L, index));
+	if (buf[strspn(buf, "-0123456789")] == '\0') {
+		buf[len++] = '.';
+		buf[len++] = '0';
+		buf[len] = '\0';
 	}
-	if (template->env != lua_topointer(L, 2)) {
-		template_setenv(L, template);
-		template->env = lua_topointer(L, 2);
+	return len;
+}
+
+static void template_write (render_t *r, const char *str, size_t len) {
+	if (r->capture) {
+		memcpy(r->capture + r->capture_len, str, len);
+		r->capture_len += len;
+		return;
+	}
+	if (r->buffer) {
+		luaL_addlstring(r->buffer, str, len);
+		return;
 	}
+	if (r->max_bytes && r->written + len > r->max_bytes) {
+		template_limit(r, "render output limit exceeded");
+	}
+	if (r->rope) {
+		template_rope_write(r, str, len);
+	} else if (fwrite(str, 1, len, r->f) != len) {
+		luaL_error(r->L, "error writing template");
+	}
+	template_written(r, str, len);
+}
 
-	/* render template */
-	i = 0;
-	while (i < template->nodes->count) {
-		node = list_get(template->nodes, i);
-		switch (node->type) {
-		case NT_NONE:
-			i++;
-			break;
+static void template_written (render_t *r, const char *str, size_t len) {
+	if (r->hashing) {
+		hash_update(&r->hash, str, len);
+	}
+	r->written += len;
+	if (r->flush_after && r->written >= r->flush_after) {
+		r->flush_after = 0;
+		template_flush(r);
+	}
+}
 
-		case NT_JUMP:
-			i = node->jump_next;
-			break;
+static void template_write_raw (render_t *r, const char *str, size_t len) {
+	rope_t        *rope;
+	struct iovec  *slice;
 
-		case NT_IF:
-			template_eval(L, node->if_ref, 1);
-			if (lua_toboolean(L, -1)) {
-				i++;
-			} else {
-				i = node->if_next;
-			}
-			lua_pop(L, 1);
-			break;
+	/* reference raw content of sufficient length from the rope */
+	rope = r->rope;
+	if (!rope || r->capture || len < TEMPLATE_ROPE_REF) {
+		template_write(r, str, len);
+		return;
+	}
+	if (r->max_bytes && r->written + len > r->max_bytes) {
+		template_limit(r, "render output limit exceeded");
+	}
+	slice = list_append(rope->slices);
+	if (!slice) {
+		luaL_error(r->L, "out of memory");
+	}
+	slice->iov_base = (void *)str;
+	slice->iov_len = len;
+	rope->arena = 0;
+	rope->len += len;
+	template_written(r, str, len);
+}
 
-		case NT_FOR_INIT:
-			template_eval(L, node->for_init_ref, 3);
-			i++;
-			break;
+static void template_rope_write (render_t *r, const char *str, size_t len) {
+	char          *chunk, **entry;
+	size_t         size;
+	rope_t        *rope;
+	struct iovec  *slice;
+
+	/* allocate chunk as needed */
+	rope = r->rope;
+	if (len > rope->avail) {
+		size = len > TEMPLATE_ROPE_CHUNK ? len : TEMPLATE_ROPE_CHUNK;
+		entry = list_append(rope->chunks);
+		if (!entry || !(chunk = malloc(size))) {
+			luaL_error(r->L, "out of memory");
+		}
+		*entry = chunk;
+		rope->pos = chunk;
+		rope->avail = size;
+		rope->arena = 0;
+	}
 
-		case NT_FOR_NEXT:
-			lua_pushvalue(L, -3);
-			lua_pushvalue(L, -3);
-			lua_pushvalue(L, -3);
-			nret = node->for_next_names->count;
-			lua_call(L, 2, nret);
-			if (lua_isnil(L, -nret)) {
-				lua_pop(L, 3 + nret);
-				i = node->for_next_next;
-			} else {
-				lua_pushvalue(L, -nret);
-				lua_replace(L, -1 - nret - 1);
-				while (nret > 0) {
-					nret--;
-					lua_setfield(L, 2, *(const char **)list_get(node->for_next_names, nret));
-				}
-				i++;
+	/* extend the last slice if it ends at the chunk position */
+	if (rope->arena) {
+		slice = list_get(rope->slices, rope->slices->count - 1);
+		slice->iov_len += len;
+	} else {
+		slice = list_append(rope->slices);
+		if (!slice) {
+			luaL_error(r->L, "out of memory");
+		}
+		slice->iov_base = rope->pos;
+		slice->iov_len = len;
+		rope->arena = 1;
+	}
+	memcpy(rope->pos, str, len);
+	rope->pos += len;
+	rope->avail -= len;
+	rope->len += len;
+}
+
+static void template_flush (render_t *r) {
+	if (r->flushing && fflush(r->f) != 0) {
+		luaL_error(r->L, "error flushing template");
+	}
+}
+
+static void template_escape (render_t *r, const char *str, size_t len, const char **escapes) {
+	const char  *c, *end, *run, *escape;
+
+	/* write runs of characters not requiring escaping in bulk */
+	run = str;
+	end = str + len;
+	for (c = str; c < end; c++) {
+		escape = escapes[(unsigned char)*c];
+		if (escape) {
+			if (c > run) {
+				template_write(r, run, c - run);
 			}
-			break;
+			template_write(r, escape, strlen(escape));
+			run = c + 1;
+		}
+	}
+	if (end > run) {
+		template_write(r, run, end - run);
+	}
+}
 
-		case NT_SET:
-			nret = node->set_names->count;
-			template_eval(L, node->set_ref, nret);
-			while (nret > 0) {
-				nret--;
-				lua_setfield(L, 2, *(const char **)list_get(node->set_names, nret));
+static void template_escape_hex (render_t *r, const char *str, size_t len, const char *safe,
+		const char *prefix, const char *suffix) {
+	char         hex[8];
+	size_t       prefix_len, hex_len;
+	const char  *c, *end, *run;
+
+	/* escape unsafe characters as prefix, two hexadecimal digits, and suffix */
+	prefix_len = strlen(prefix);
+	hex_len = prefix_len + 2 + strlen(suffix);
+	memcpy(hex, prefix, prefix_len);
+	memcpy(hex + prefix_len + 2, suffix, hex_len - prefix_len - 2);
+	run = str;
+	end = str + len;
+	for (c = str; c < end; c++) {
+		if (!safe[(unsigned char)*c]) {
+			if (c > run) {
+				template_write(r, run, c - run);
 			}
-			i++;
-			break;
- 
-		case NT_INCLUDE:
-			template_eval_str(L, node->include_ref);
-			template_render_template(L, f, lua_tostring(L, -1), depth + 1);
-			lua_pop(L, 1);
-			i++;
-			break;			
+			hex[prefix_len] = template_hex_digits[(unsigned char)*c >> 4];
+			hex[prefix_len + 1] = template_hex_digits[(unsigned char)*c & 0xf];
+			template_write(r, hex, hex_len);
+			run = c + 1;
+		}
+	}
+	if (end > run) {
+		template_write(r, run, end - run);
+	}
+}
 
-		case NT_SUB:
-			template_eval(L, node->sub_ref, 1);
-			if (lua_isstring(L, -1)) {
-				str = lua_tostring(L, -1);
-			} else if (lua_isnil(L, -1) && (node->sub_flags & TEMPLATE_FSUPNIL)) {
-				str = "";
-			} else {
-				lua_pushfstring(L, "(%s)", luaL_typename(L, -1));
-				lua_replace(L, -2);
-				str = lua_tostring(L, -1);
-			}
-			switch (node->sub_flags & TEMPLATE_FESC) {
-			case TEMPLATE_FESCXML:
-				result = 0;
-				for (c = str; *c != '\0'; c++) {
-					switch (*c) {
-					case '"':
-						result = fputs("&quot;", f);
-						break;
-
-					case '\'':
-						result = fputs("&apos;", f);
-						break;
-
-					case '<':
-						result = fputs("&lt;", f);
-						break;
-
-					case '>':
-						result = fputs("&gt;", f);
-						break;
-
-					case '&':
-						result = fputs("&amp;", f);
-						break;
-
-					default:
-						result = fputc(*c, f);
-					}
-					if (result == EOF) {
-						break;
-					}
-				}
-				break;
+static void template_escape_csv (render_t *r, const char *str, size_t len) {
+	const char  *c, *end;
 
-			case TEMPLATE_FESCURL:
-				result = 0;
-				for (c = str; *c != '\0'; c++) {
-					if (isalnum(*c) || *c == '-' || *c == '.' || *c == '_' || *c == '~') {
-						result = fputc(*c, f);
-					} else {
-						result = (fputc('%', f) != EOF
-								&& fputc(template_hex_digits[*c / 16], f) != EOF
-								&& fputc(template_hex_digits[*c % 16], f) != EOF) ? 3 : EOF;
-					}
-					if (result == EOF) {
-						break;
-					}
-				}
-				break;
+	/* quote the field only if it contains special characters */
+	end = str + len;
+	c = str;
+	while (c < end && !template_special_csv[(unsigned char)*c]) {
+		c++;
+	}
+	if (c == end) {
+		template_write(r, str, len);
+		return;
+	}
+	template_write(r, "\"", 1);
+	template_escape(r, str, len, template_escapes_csv);
+	template_write(r, "\"", 1);
+}
+
+static void template_output (render_t *r, const char *str, size_t len, int flags) {
+	switch (flags & TEMPLATE_FESC) {
+	case TEMPLATE_FESCXML:
+		template_escape(r, str, len, template_escapes_xml);
+		break;
+
+	case TEMPLATE_FESCURL:
+		template_escape_hex(r, str, len, template_safe_url, "%", "");
+		break;
+
+	case TEMPLATE_FESCJS:
+		template_escape(r, str, len, template_escapes_js);
+		break;
 
-			case TEMPLATE_FESCJS:
-				result = 0;
-				for (c = str; *c != '\0'; c++) {
-					switch (*c) {
-					case '\b':
-						result = fputs("\\b", f);
-						break;
+	case TEMPLATE_FESCCSS:
+		template_escape_hex(r, str, len, template_safe_css, "\\", " ");
+		break;
 
-					case '\t':
-						result = fputs("\\t", f);
-						break;
+	case TEMPLATE_FESCATTR:
+		template_escape_hex(r, str, len, template_safe_attr, "&#x", ";");
+		break;
 
-					case '\n':
-						result = fputs("\\n", f);
-						break;
+	case TEMPLATE_FESCCSV:
+		template_escape_csv(r, str, len);
+		break;
 
-					case '\v':
-						result = fputs("\\v", f);
-						break;
+	case TEMPLATE_FESCJSON:
+		template_escape_json(r, str, len, flags & ~TEMPLATE_FESC);
+		break;
 
-					case '\f':
-						result = fputs("\\f", f);
-						break;
+	default:
+		template_write(r, str, len);
+	}
+}
 
-					case '\r':
-						result = fputs("\\r", f);
-						break;
+static void template_escape_json (render_t *r, const char *str, size_t len, int flags) {
+	char                  escape[7];
+	size_t                escape_len;
+	const unsigned char  *c, *end, *run;
+
+	/* escape quotes, backslashes, control characters, '</', and JavaScript line terminators */
+	run = (const unsigned char *)str;
+	end = run + len;
+	for (c = run; c < end; c++) {
+		if (*c < 0x20) {
+			switch (*c) {
+			case '\b':
+				memcpy(escape, "\\b", escape_len = 2);
+				break;
 
-					case '"':
-						result = fputs("\\\"", f);
-						break;
+			case '\f':
+				memcpy(escape, "\\f", escape_len = 2);
+				break;
 
-					case '\'':
-						result = fputs("\\'", f);
-						break;
+			case '\n':
+				memcpy(escape, "\\n", escape_len = 2);
+				break;
 
-					case '\\':
-						result = fputs("\\\\", f);
-						break;
+			case '\r':
+				memcpy(escape, "\\r", escape_len = 2);
+				break;
 
-					default:
-						result = fputc(*c, f);
-					}
-					if (result == EOF) {
-						break;
-					}
-				}
+			case '\t':
+				memcpy(escape, "\\t", escape_len = 2);
 				break;
 
 			default:
-				result = fputs(str, f);
+				memcpy(escape, "\\u00", 4);
+				escape[4] = template_hex_digits[*c >> 4];
+				escape[5] = template_hex_digits[*c & 0xf];
+				escape_len = 6;
 			}
-			if (result == EOF) {
-				luaL_error(L, "error writing template");
-			}
-			lua_pop(L, 1);
-			i++;
-			break;
-
-		case NT_RAW:
-			if (fwrite(node->raw_str, 1, node->raw_len, f) != node->raw_len) {
-				luaL_error(L, "error writing template");
+		} else if (*c == '"' || *c == '\\') {
+			escape[0] = '\\';
+			escape[1] = *c;
+			escape_len = 2;
+		} else if (*c == '/' && c > (const unsigned char *)str && c[-1] == '<') {
+			memcpy(escape, "\\/", escape_len = 2);
+		} else if (*c == 0xe2 && end - c >= 3 && c[1] == 0x80 && (c[2] & 0xfe) == 0xa8) {
+			memcpy(escape, c[2] == 0xa8 ? "\\u2028" : "\\u2029", escape_len = 6);
+			if (c > run) {
+				template_output(r, (const char *)run, c - run, flags);
 			}
-			i++;
-			break;
+			template_output(r, escape, escape_len, flags);
+			c += 2;
+			run = c + 1;
+			continue;
+		} else {
+			continue;
+		}
+		if (c > run) {
+			template_output(r, (const char *)run, c - run, flags);
 		}
+		template_output(r, escape, escape_len, flags);
+		run = c + 1;
+	}
+	if (end > run) {
+		template_output(r, (const char *)run, end - run, flags);
 	}
-
-	/* pop template */
-	lua_pop(L, 1);
 }
 
-static int template_fclose (lua_State *L) {
-	int           result;
-	memstream_t  *memstream;
+static uint64_t template_cache_slot (cache_t *cache, const char *str, int escape) {
+	uint64_t  h;
 
-	memstream = luaL_checkudata(L, 1, LUA_FILEHANDLE);
+	/* Fibonacci hashing of the string address; one region of slots per escape */
+	h = ((uintptr_t)str >> 3) * 11400714819323198485U;
+	return (escape - 1) * cache->slots + (h >> (64 - cache->bits));
+}
+
+static void template_output_cached (render_t *r, int index, const char *str, size_t len,
+		int flags) {
+	char            buf[TEMPLATE_MAX_CACHED * TEMPLATE_MAX_EXPANSION + 2];
+	uint64_t        slot;
+	lua_State      *L;
+	cache_entry_t  *entry;
+
+	/* hit; the string is anchored while cached, so its address cannot be reused */
+	slot = template_cache_slot(r->cache, str, flags & TEMPLATE_FESC);
+	entry = &r->cache->entries[slot];
+	if (entry->str == str && entry->len == len) {
+		if (entry->escaped) {
+			template_write(r, entry->escaped, entry->escaped_len);
+		} else {
+			template_write(r, str, len);
+		}
+		return;
+	}
+
+	/* miss; capture the escaped string */
+	r->capture = buf;
+	r->capture_len = 0;
+	template_output(r, str, len, flags);
+	r->capture = NULL;
+	free(entry->escaped);
+	entry->escaped = NULL;
+	entry->str = NULL;
+	entry->len = 0;
+	if (r->capture_len != len || memcmp(buf, str, len) != 0) {
+		entry->escaped = malloc(r->capture_len);
+		if (!entry->escaped) {
+			luaL_error(r->L, "out of memory");
+		}
+		memcpy(entry->escaped, buf, r->capture_len);
+		entry->escaped_len = r->capture_len;
+	}
+	L = r->L;
+	lua_getuservalue(L, r->escapes);
+	lua_pushvalue(L, index);
+	lua_rawseti(L, -2, slot + 1);
+	lua_pop(L, 1);
+	entry->str = str;
+	entry->len = len;
+	template_write(r, buf, r->capture_len);
+}
+
+static void template_json_string (render_t *r, const char *str, size_t len, int flags) {
+	template_output(r, "\"", 1, flags);
+	template_escape_json(r, str, len, flags);
+	template_output(r, "\"", 1, flags);
+}
+
+static void template_json (render_t *r, int index, int flags, int depth) {
+	int          first, array;
+	char         value[TEMPLATE_MAX_VALUE];
+	size_t       len, n, count, k;
+	lua_State   *L;
+	const char  *str;
+
+	L = r->L;
+	index = lua_absindex(L, index);
+	switch (lua_type(L, index)) {
+	case LUA_TNIL:
+		template_output(r, "null", 4, flags);
+		break;
+
+	case LUA_TBOOLEAN:
+		if (lua_toboolean(L, index)) {
+			template_output(r, "true", 4, flags);
+		} else {
+			template_output(r, "false", 5, flags);
+		}
+		break;
+
+	case LUA_TNUMBER:
+		if (!lua_isinteger(L, index) && !isfinite(lua_tonumber(L, index))) {
+			template_output(r, "null", 4, flags);
+		} else {
+			len = template_format_number(L, index, value);
+			template_output(r, value, len, flags);
+		}
+		break;
+
+	case LUA_TSTRING:
+		str = lua_tolstring(L, index, &len);
+		template_json_string(r, str, len, flags);
+		break;
+
+	case LUA_TTABLE:
+		if (depth > TEMPLATE_MAX_JSON) {
+			luaL_error(L, "JSON nesting exceeds %d", TEMPLATE_MAX_JSON);
+		}
+		luaL_checkstack(L, 3, NULL);
+
+		/* serialize as an array if the keys are exactly 1..n */
+		n = lua_rawlen(L, index);
+		array = n > 0;
+		count = 0;
+		lua_pushnil(L);
+		while (lua_next(L, index)) {
+			if (!lua_isinteger(L, -2) || lua_tointeger(L, -2) < 1
+					|| (size_t)lua_tointeger(L, -2) > n) {
+				array = 0;
+				lua_pop(L, 2);
+				break;
+			}
+			count++;
+			lua_pop(L, 1);
+		}
+		if (array && count == n) {
+			template_output(r, "[", 1, flags);
+			for (k = 1; k <= n; k++) {
+				if (k > 1) {
+					template_output(r, ",", 1, flags);
+				}
+				lua_rawgeti(L, index, k);
+				template_json(r, -1, flags, depth + 1);
+				lua_pop(L, 1);
+			}
+			template_output(r, "]", 1, flags);
+		} else {
+			template_output(r, "{", 1, flags);
+			first = 1;
+			lua_pushnil(L);
+			while (lua_next(L, index)) {
+				switch (lua_type(L, -2)) {
+				case LUA_TSTRING:
+					str = lua_tolstring(L, -2, &len);
+					break;
+
+				case LUA_TNUMBER:
+					len = template_format_number(L, -2, value);
+					str = value;
+					break;
+
+				default:
+					luaL_error(L, "bad JSON key type: %s", luaL_typename(L, -2));
+					return;
+				}
+				if (!first) {
+					template_output(r, ",", 1, flags);
+				}
+				first = 0;
+				template_json_string(r, str, len, flags);
+				template_output(r, ":", 1, flags);
+				template_json(r, -1, flags, depth + 1);
+				lua_pop(L, 1);
+			}
+			template_output(r, "}", 1, flags);
+		}
+		break;
+
+	default:
+		luaL_error(L, "cannot serialize %s to JSON", luaL_typename(L, index));
+	}
+}
+
+static size_t template_format_custom (lua_State *L, int index, const char *format, int flags,
+		char *buf) {
+	int          len, isint;
+	lua_Integer  n;
+
+	if (flags & TEMPLATE_FFMTINT) {
+		n = lua_tointegerx(L, index, &isint);
+		if (!isint) {
+			luaL_error(L, "number has no integer representation");
+		}
+		len = snprintf(buf, TEMPLATE_MAX_FORMAT, format, n);
+	} else {
+		len = snprintf(buf, TEMPLATE_MAX_FORMAT, format, (double)lua_tonumber(L, index));
+	}
+	if (len < 0 || len >= TEMPLATE_MAX_FORMAT) {
+		luaL_error(L, "formatted number too long");
+	}
+	return len;
+}
+
+static int template_write_safe (render_t *r, int index) {
+	size_t       len;
+	lua_State   *L;
+	const char  *str;
+
+	L = r->L;
+	if (!luaL_testudata(L, index, TEMPLATE_SAFE)) {
+		return 0;
+	}
+	lua_getuservalue(L, index);
+	str = lua_tolstring(L, -1, &len);
+	template_write(r, str, len);
+	lua_pop(L, 1);
+	return 1;
+}
+
+static void template_sub_value (render_t *r, int index, int flags, subopts_t *opts) {
+	char         value[TEMPLATE_MAX_VALUE], formatted[TEMPLATE_MAX_FORMAT];
+	size_t       len;
+	lua_State   *L;
+	const char  *str;
+
+	L = r->L;
+	if (lua_type(L, index) == LUA_TUSERDATA && template_write_safe(r, index)) {
+		return;
+	}
+	if (opts && opts->format && lua_isnumber(L, index)) {
+		len = template_format_custom(L, index, opts->format, flags, formatted);
+		template_output(r, formatted, len, flags);
+		return;
+	}
+	switch (lua_type(L, index)) {
+	case LUA_TSTRING:
+		str = lua_tolstring(L, index, &len);
+		if (r->cache && (flags & TEMPLATE_FESC) && len <= TEMPLATE_MAX_CACHED) {
+			template_output_cached(r, lua_absindex(L, index), str, len, flags);
+			return;
+		}
+		break;
+
+	case LUA_TNUMBER:
+		len = template_format_number(L, index, value);
+		str = value;
+		break;
+
+	default:
+		len = snprintf(value, sizeof(value), "(%s)", luaL_typename(L, index));
+		str = value;
+	}
+	template_output(r, str, len, flags);
+}
+
+static void template_sub (render_t *r, int index, int flags, subopts_t *opts) {
+	int           first;
+	lua_State    *L;
+	lua_Integer   n, k;
+
+	L = r->L;
+	switch (lua_type(L, index)) {
+	case LUA_TNIL:
+		if (flags & TEMPLATE_FSUPNIL) {
+			return;
+		}
+		break;
+
+	case LUA_TUSERDATA:
+		if (template_write_safe(r, index)) {
+			return;
+		}
+		break;
+	}
+	if (flags & TEMPLATE_FJSON) {
+		template_json(r, index, flags, 1);
+		return;
+	}
+	if (opts && opts->join && lua_istable(L, index)) {
+		index = lua_absindex(L, index);
+		n = luaL_len(L, index);
+		first = 1;
+		for (k = 1; k <= n; k++) {
+			/* nil elements are skipped along with their separator if suppressed */
+			if (lua_geti(L, index, k) == LUA_TNIL && (flags & TEMPLATE_FSUPNIL)) {
+				lua_pop(L, 1);
+				continue;
+			}
+			if (!first) {
+				template_write(r, opts->join, opts->join_len);
+			}
+			first = 0;
+			template_sub_value(r, -1, flags, opts);
+			lua_pop(L, 1);
+		}
+		return;
+	}
+	template_sub_value(r, index, flags, opts);
+}
+
+static void template_message (render_t *r, node_t *node) {
+	size_t       len;
+	lua_State   *L;
+	subopts_t   *opts;
+	message_t   *message;
+	const char  *key;
+
+	/* message resolved when parsing */
+	opts = node->sub_opts;
+	if (r->catalog && opts && r->catalog->index < opts->messages_count
+			&& opts->messages[r->catalog->index]) {
+		message = opts->messages[r->catalog->index];
+		template_write_raw(r, message->str, message->len);
+		return;
+	}
+
+	/* look up the key in the catalog; a key without message is substituted as is */
+	L = r->L;
+	template_eval(L, node->sub_ref, 1);
+	if (lua_isnil(L, -1) && (node->sub_flags & TEMPLATE_FSUPNIL)) {
+		lua_pop(L, 1);
+		return;
+	}
+	if (!lua_isstring(L, -1)) {
+		lua_pushfstring(L, "(%s)", luaL_typename(L, -1));
+		lua_replace(L, -2);
+	}
+	key = lua_tolstring(L, -1, &len);
+	message = r->catalog ? table_get(r->catalog->messages, key) : NULL;
+	if (message) {
+		template_output(r, message->str, message->len, node->sub_flags);
+	} else {
+		template_output(r, key, len, node->sub_flags);
+	}
+	lua_pop(L, 1);
+}
+
+static void template_esi (render_t *r, const char *filename) {
+	size_t       len;
+	lua_State   *L;
+	const char  *src;
+
+	/* map the template name to the include source, if a function is set */
+	L = r->L;
+	if (lua_isfunction(L, r->esi_option)) {
+		lua_pushvalue(L, r->esi_option);
+		lua_pushstring(L, filename);
+		lua_call(L, 1, 1);
+		if (!lua_isstring(L, -1)) {
+			luaL_error(L, "%s: error mapping edge-side include", filename);
+		}
+	} else {
+		lua_pushstring(L, filename);
+	}
+	src = lua_tolstring(L, -1, &len);
+	template_write(r, "<esi:include src=\"", 18);
+	template_escape(r, src, len, template_escapes_xml);
+	template_write(r, "\"/>", 3);
+	lua_pop(L, 1);
+}
+
+static uint64_t template_clock (void) {
+	struct timespec  ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void template_limit (render_t *r, const char *msg) {
+	/* reset the file handle to where rendering started, as far as possible */
+	if (r->flushing) {
+		__fpurge(r->f);
+		/* only truncate if no prior content follows the start; otherwise, just seek back */
+		if (r->start >= 0 && (!r->truncate || ftruncate(fileno(r->f), r->start) == 0)) {
+			fseeko(r->f, r->start, SEEK_SET);
+		}
+	}
+	luaL_error(r->L, "%s", msg);
+}
+
+static void template_check_deadline (render_t *r) {
+	if (++r->ticks % TEMPLATE_DEADLINE_TICKS == 0 && template_clock() >= r->deadline) {
+		template_limit(r, "render deadline exceeded");
+	}
+}
+
+static int template_rawclose (lua_State *L) {
+	luaL_Stream  *stream;
+
+	stream = luaL_checkudata(L, 1, LUA_FILEHANDLE);
+	return luaL_fileresult(L, fclose(stream->f) == 0, NULL);
+}
+
+static void template_rawinclude (render_t *r, const char *filename) {
+	int           in, out;
+	char          buf[TEMPLATE_RAW_BUFFER];
+	size_t        len;
+	ssize_t       n;
+	lua_State    *L;
+	const char   *str;
+	struct stat   statbuf;
+	luaL_Stream  *stream;
+
+	/* registered source */
+	L = r->L;
+	if (template_source(L, filename)) {
+		str = lua_tolstring(L, -1, &len);
+		template_write(r, str, len);
+		lua_pop(L, 1);
+		return;
+	}
+
+	/* archive member */
+	if ((str = template_member(L, filename, &len)) != NULL) {
+		template_write(r, str, len);
+		return;
+	}
+
+	/* custom resolver */
+	if (lua_getfield(L, LUA_REGISTRYINDEX, TEMPLATE_RESOLVER) != LUA_TNIL) {
+		template_resolver_call(L, filename);
+		if (!lua_isstring(L, -1)) {
+			luaL_error(L, "%s: error resolving file", filename);
+		}
+		str = lua_tolstring(L, -1, &len);
+		template_write(r, str, len);
+		lua_pop(L, 1);
+		return;
+	}
+	lua_pop(L, 1);
+
+	/* open file as a Lua stream, so it is closed if an error occurs */
+	stream = lua_newuserdata(L, sizeof(luaL_Stream));
+	stream->closef = NULL;
+	luaL_setmetatable(L, LUA_FILEHANDLE);
+	stream->f = fopen(filename, "r");
+	if (!stream->f) {
+		luaL_error(L, "%s: file not found", filename);
+	}
+	stream->closef = template_rawclose;
+	in = fileno(stream->f);
+
+	/* move the bytes in the kernel when writing unhashed to a file handle */
+	if (r->flushing && !r->hashing && fstat(in, &statbuf) == 0 && S_ISREG(statbuf.st_mode)) {
+		if (r->max_bytes && r->written + statbuf.st_size > r->max_bytes) {
+			template_limit(r, "render output limit exceeded");
+		}
+		template_flush(r);
+		out = fileno(r->f);
+		len = statbuf.st_size;
+		while (len > 0) {
+			n = sendfile(out, in, NULL, len);
+			if (n <= 0) {
+				break;
+			}
+			len -= n;
+			r->written += n;
+		}
+		if (r->flush_after && r->written >= r->flush_after) {
+			r->flush_after = 0;
+		}
+	}
+
+	/* copy the remaining bytes, if any */
+	while ((len = fread(buf, 1, sizeof(buf), stream->f)) > 0) {
+		template_write(r, buf, len);
+	}
+	if (ferror(stream->f)) {
+		luaL_error(L, "%s: error reading file", filename);
+	}
+	stream->closef = NULL;
+	if (fclose(stream->f) != 0) {
+		luaL_error(L, "%s: error closing file", filename);
+	}
+	lua_pop(L, 1);
+}
+
+static int template_track_index (lua_State *L) {
+	/* record the key read, and read it from the environment */
+	lua_pushvalue(L, 2);
+	lua_pushboolean(L, 1);
+	lua_rawset(L, lua_upvalueindex(2));
+	lua_pushvalue(L, 2);
+	lua_gettable(L, lua_upvalueindex(1));
+	return 1;
+}
+
+static int template_track_newindex (lua_State *L) {
+	/* record the key written, and write it to the environment */
+	lua_pushvalue(L, 2);
+	lua_pushboolean(L, 1);
+	lua_rawset(L, lua_upvalueindex(2));
+	lua_pushvalue(L, 2);
+	lua_pushvalue(L, 3);
+	lua_settable(L, lua_upvalueindex(1));
+	return 0;
+}
+
+static size_t template_block_end (template_t *t, size_t i) {
+	size_t   end, next;
+	node_t  *node;
+
+	/* a top-level block extends to the farthest node its nodes can continue at */
+	end = i + 1;
+	while (i < end) {
+		node = list_get(t->nodes, i);
+		switch (node->type) {
+		case NT_JUMP:
+			next = node->jump_next;
+			break;
+
+		case NT_IF:
+			next = node->if_next;
+			break;
+
+		case NT_FOR_INIT:
+			next = i + 2;
+			break;
+
+		case NT_FOR_NEXT:
+			next = node->for_next_next;
+			break;
+
+		default:
+			next = i + 1;
+		}
+		if (next > end) {
+			end = next;
+		}
+		i++;
+	}
+	return end;
+}
+
+static int template_block_affected (render_t *r, int id) {
+	lua_State  *L;
+
+	/* a block is affected if it has not been tracked, or it has read a changed key */
+	L = r->L;
+	if (lua_rawgeti(L, r->deps, id) != LUA_TTABLE) {
+		lua_pop(L, 1);
+		return 1;
+	}
+	lua_pushnil(L);
+	while (lua_next(L, -2)) {
+		lua_pop(L, 1);
+		lua_pushvalue(L, -1);
+		if (lua_rawget(L, r->changed) != LUA_TNIL) {
+			lua_pop(L, 3);
+			return 1;
+		}
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+	return 0;
+}
+
+static void template_render_tracked (render_t *r, template_t *template) {
+	int          id, affected, set;
+	size_t       i, end, start;
+	node_t      *node;
+	lua_State   *L;
+
+	/* render top-level blocks, tracking the keys each block reads and writes */
+	L = r->L;
+	lua_getmetatable(L, 2);
+	i = 0;
+	id = 0;
+	start = 0;
+	while (i < template->nodes->count) {
+		end = template_block_end(template, i);
+		id++;
+		node = list_get(template->nodes, i);
+		set = node->type == NT_SET && end == i + 1;
+		affected = !r->patching || template_block_affected(r, id);
+		if (!affected && !set) {
+			/* skip unaffected block; set blocks are always evaluated to maintain variables */
+			i = end;
+			continue;
+		}
+		lua_newtable(L);
+		lua_newtable(L);
+		lua_getfield(L, -3, "__index");
+		lua_pushvalue(L, -3);
+		lua_setupvalue(L, -2, 2);
+		lua_pop(L, 1);
+		lua_getfield(L, -3, "__newindex");
+		lua_pushvalue(L, -2);
+		lua_setupvalue(L, -2, 2);
+		lua_pop(L, 1);
+		if (r->patching && affected) {
+			template_flush_patch(r);
+			start = r->patching->len;
+		}
+		template_render_nodes(r, template, i, end, 1);
+		if (affected) {
+			if (r->patching) {
+				/* record patch, and propagate the keys written */
+				if (!set) {
+					template_flush_patch(r);
+					lua_createtable(L, 0, 2);
+					lua_pushinteger(L, id);
+					lua_setfield(L, -2, "id");
+					lua_pushlstring(L, r->patching->str + start, r->patching->len - start);
+					lua_setfield(L, -2, "html");
+					lua_rawseti(L, r->patches, luaL_len(L, r->patches) + 1);
+				}
+				lua_pushnil(L);
+				while (lua_next(L, -2)) {
+					lua_pushvalue(L, -2);
+					lua_insert(L, -2);
+					lua_rawset(L, r->changed);
+				}
+			}
+			lua_pushvalue(L, -2);
+			lua_rawseti(L, r->deps, id);
+		}
+		lua_pop(L, 2);
+		i = end;
+	}
+	lua_pop(L, 1);
+}
+
+static void template_flush_patch (render_t *r) {
+	if (fflush(r->f) != 0) {
+		luaL_error(r->L, "error flushing memory stream");
+	}
+}
+
+static void template_dataset_init (lua_State *L) {
+	row_t  *row;
+
+	/* replace the iteration state of a dataset with a row cursor and a row counter */
+	if (lua_type(L, -3) != LUA_TUSERDATA || !luaL_testudata(L, -3, TEMPLATE_DATASET)) {
+		return;
+	}
+	row = lua_newuserdata(L, sizeof(row_t));
+	row->row = 0;
+	row->ds = lua_touserdata(L, -4);
+	row->column = row->ds->count;
+	luaL_setmetatable(L, TEMPLATE_ROW);
+	lua_getuservalue(L, -4);
+	lua_setuservalue(L, -2);
+	lua_replace(L, -3);
+	lua_pushinteger(L, 0);
+	lua_replace(L, -2);
+}
+
+static int template_dataset_next (lua_State *L, node_t *node) {
+	size_t      n, i;
+	row_t      *row;
+	list_t     *names;
+	dataset_t  *ds;
+
+	/* advance the row cursor, and assign the row number and cursor, or the cursor alone */
+	ds = lua_touserdata(L, -3);
+	n = (size_t)lua_tointeger(L, -1);
+	if (n >= ds->rows) {
+		return 0;
+	}
+	row = lua_touserdata(L, -2);
+	row->row = n;
+	lua_pushinteger(L, (lua_Integer)n + 1);
+	lua_replace(L, -2);
+	names = node->for_next_names;
+	if (names->count == 1) {
+		lua_pushvalue(L, -2);
+		lua_setfield(L, 2, *(const char **)list_get(names, 0));
+		return 1;
+	}
+	lua_pushinteger(L, (lua_Integer)n + 1);
+	lua_setfield(L, 2, *(const char **)list_get(names, 0));
+	lua_pushvalue(L, -2);
+	lua_setfield(L, 2, *(const char **)list_get(names, 1));
+	for (i = 2; i < names->count; i++) {
+		lua_pushnil(L);
+		lua_setfield(L, 2, *(const char **)list_get(names, i));
+	}
+	return 1;
+}
+
+static void template_render_nodes (render_t *r, template_t *template, size_t first, size_t last,
+		int depth) {
+	node_t      *node;
+	size_t       i, nret;
+	lua_State   *L;
+
+	L = r->L;
+	i = first;
+	while (i < last) {
+		if (r->deadline) {
+			template_check_deadline(r);
+		}
+		node = list_get(template->nodes, i);
+		switch (node->type) {
+		case NT_NONE:
+			i++;
+			break;
+
+		case NT_JUMP:
+			i = node->jump_next;
+			break;
+
+		case NT_IF:
+			template_eval(L, node->if_ref, 1);
+			if (lua_toboolean(L, -1)) {
+				i++;
+			} else {
+				i = node->if_next;
+			}
+			lua_pop(L, 1);
+			break;
+
+		case NT_FOR_INIT:
+			template_eval(L, node->for_init_ref, 3);
+			template_dataset_init(L);
+			i++;
+			break;
+
+		case NT_FOR_NEXT:
+			if (lua_type(L, -3) == LUA_TUSERDATA && luaL_testudata(L, -3, TEMPLATE_DATASET)) {
+				if (template_dataset_next(L, node)) {
+					i++;
+				} else {
+					lua_pop(L, 3);
+					i = node->for_next_next;
+				}
+				break;
+			}
+			lua_pushvalue(L, -3);
+			lua_pushvalue(L, -3);
+			lua_pushvalue(L, -3);
+			nret = node->for_next_names->count;
+			lua_call(L, 2, nret);
+			if (lua_isnil(L, -nret)) {
+				lua_pop(L, 3 + nret);
+				i = node->for_next_next;
+			} else {
+				lua_pushvalue(L, -nret);
+				lua_replace(L, -1 - nret - 1);
+				while (nret > 0) {
+					nret--;
+					lua_setfield(L, 2, *(const char **)list_get(node->for_next_names, nret));
+				}
+				i++;
+			}
+			break;
+
+		case NT_SET:
+			nret = node->set_names->count;
+			template_eval(L, node->set_ref, nret);
+			while (nret > 0) {
+				nret--;
+				lua_setfield(L, 2, *(const char **)list_get(node->set_names, nret));
+			}
+			i++;
+			break;
+ 
+		case NT_INCLUDE:
+			template_eval_str(L, node->include_ref);
+			if (node->include_esi && r->esi) {
+				template_esi(r, lua_tostring(L, -1));
+			} else {
+				template_render_template(r, lua_tostring(L, -1), depth + 1);
+			}
+			lua_pop(L, 1);
+			i++;
+			break;			
+
+		case NT_RAWINCLUDE:
+			template_eval_str(L, node->rawinclude_ref);
+			template_rawinclude(r, lua_tostring(L, -1));
+			lua_pop(L, 1);
+			i++;
+			break;
+
+		case NT_FLUSH:
+			template_flush(r);
+			i++;
+			break;
+
+		case NT_SUB:
+			if (node->sub_flags & TEMPLATE_FMESSAGE) {
+				template_message(r, node);
+			} else {
+				template_eval(L, node->sub_ref, 1);
+				template_sub(r, -1, node->sub_flags, node->sub_opts);
+				lua_pop(L, 1);
+			}
+			i++;
+			break;
+
+		case NT_RAW:
+			template_write_raw(r, node->raw_str, node->raw_len);
+			i++;
+			break;
+		}
+	}
+}
+
+static void template_prefetch_add (lua_State *L, int templates, const char *filename,
+		int requested, int pending) {
+	int     loaded;
+	size_t  len;
+
+	/* skip templates loaded or requested before */
+	lua_getfield(L, templates, filename);
+	lua_getfield(L, requested, filename);
+	loaded = !lua_isnil(L, -2) || !lua_isnil(L, -1);
+	lua_pop(L, 2);
+	if (loaded) {
+		return;
+	}
+	lua_pushboolean(L, 1);
+	lua_setfield(L, requested, filename);
+
+	/* request templates without a registered source or archive member from the resolver */
+	if (template_source(L, filename)) {
+		lua_pop(L, 1);
+	} else if (!template_member(L, filename, &len)) {
+		lua_pushstring(L, filename);
+		lua_rawseti(L, pending, luaL_len(L, pending) + 1);
+		return;
+	}
+
+	/* parse others now; errors are left to surface when the template is rendered */
+	lua_pushcfunction(L, template_parse);
+	lua_pushstring(L, filename);
+	if (lua_pcall(L, 1, 1, 0) == LUA_OK) {
+		template_prefetched(L, templates, filename, requested, pending);
+	} else {
+		lua_pop(L, 1);
+	}
+}
+
+static void template_prefetched (lua_State *L, int templates, const char *filename,
+		int requested, int pending) {
+	size_t       i;
+	template_t  *t;
+
+	/* store the parsed template on the stack top, and add its literal includes */
+	t = lua_touserdata(L, -1);
+	lua_setfield(L, templates, filename);
+	for (i = 0; i < t->includes->count; i++) {
+		template_prefetch_add(L, templates, *(const char **)list_get(t->includes, i),
+				requested, pending);
+	}
+}
+
+static void template_prefetch (lua_State *L, int templates, const char *filename) {
+	int          requested, pending;
+	size_t       i;
+	const char  *name;
+
+	/* resolve the template and its transitive literal includes in batches */
+	lua_newtable(L);
+	requested = lua_gettop(L);
+	lua_newtable(L);
+	pending = lua_gettop(L);
+	template_prefetch_add(L, templates, filename, requested, pending);
+	while (luaL_len(L, pending) > 0) {
+		/* call the resolver with the pending templates; sources go to pending + 1 */
+		lua_getfield(L, LUA_REGISTRYINDEX, TEMPLATE_RESOLVER);
+		lua_pushvalue(L, pending);
+		lua_call(L, 1, 1);
+		if (!lua_istable(L, -1)) {
+			luaL_error(L, "%s: error resolving templates", filename);
+		}
+
+		/* parse the templates resolved, collecting newly pending templates at pending + 2 */
+		lua_newtable(L);
+		for (i = 1; lua_rawgeti(L, pending, i) == LUA_TSTRING; i++) {
+			name = lua_tostring(L, -1);
+			lua_pushcfunction(L, template_parse);
+			lua_pushvalue(L, -2);
+			lua_getfield(L, pending + 1, name);
+			if (lua_type(L, -1) == LUA_TSTRING && lua_pcall(L, 2, 1, 0) == LUA_OK) {
+				template_prefetched(L, templates, name, requested, pending + 2);
+			}
+			lua_settop(L, pending + 2);
+		}
+		lua_settop(L, pending + 2);
+		lua_replace(L, pending);
+		lua_settop(L, pending);
+	}
+	lua_settop(L, requested - 1);
+}
+
+static void template_templates (lua_State *L) {
+	/* push the templates registry, creating it as needed */
+	if (lua_getfield(L, LUA_REGISTRYINDEX, TEMPLATE_TEMPLATES) != LUA_TTABLE) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, LUA_REGISTRYINDEX, TEMPLATE_TEMPLATES);
+	}
+}
+
+static template_t *template_load (lua_State *L, int index, const char *filename) {
+	template_t  *template;
+
+	/* push the template from the templates registry at index, parsing it as needed */
+	if (lua_getfield(L, index, filename) != LUA_TUSERDATA
+			|| !(template = luaL_testudata(L, -1, TEMPLATE_TEMPLATE))) {
+		lua_pop(L, 1);
+		lua_pushcfunction(L, template_parse);
+		lua_pushstring(L, filename);
+		lua_call(L, 1, 1);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, index, filename);
+		template = lua_touserdata(L, -1);
+	}
+	return template;
+}
+
+static void template_render_template (render_t *r, const char *filename, int depth) {
+	lua_State   *L;
+	template_t  *template;
+
+	/* check depth */
+	L = r->L;
+	if (depth > TEMPLATE_MAX_DEPTH) {
+		luaL_error(L, "template depth exceeds %d", TEMPLATE_MAX_DEPTH);
+	}
+
+	/* get template */
+	template = template_load(L, r->templates, filename);
+	if (r->rope) {
+		/* anchor template, as the rope references its raw content */
+		lua_getuservalue(L, 3);
+		lua_pushvalue(L, -2);
+		lua_pushboolean(L, 1);
+		lua_rawset(L, -3);
+		lua_pop(L, 1);
+	}
+	if (template->env != lua_topointer(L, 2)) {
+		template_setenv(L, template);
+		template->env = lua_topointer(L, 2);
+	}
+
+	/* render template */
+	if (depth == 1 && r->tracking) {
+		template_render_tracked(r, template);
+	} else {
+		template_render_nodes(r, template, 0, template->nodes->count, depth);
+	}
+
+	/* pop template */
+	lua_pop(L, 1);
+}
+
+static int template_fclose (lua_State *L) {
+	int           result;
+	memstream_t  *memstream;
+
+	memstream = luaL_checkudata(L, 1, LUA_FILEHANDLE);
 	result = luaL_fileresult(L, fclose(memstream->stream.f) == 0, NULL);
 	free(memstream->str);
 	return result;
 }
 
-static int template_render (lua_State *L) {
-	int           have_stream;
-	const char   *filename;
-	luaL_Stream  *stream;
-	memstream_t  *memstream;
+static int template_render_option (lua_State *L, const char *name) {
+	/* push a field of the options at index 4, or nil, and return its stack index */
+	if (lua_istable(L, 4)) {
+		lua_getfield(L, 4, name);
+	} else {
+		lua_pushnil(L);
+	}
+	return lua_gettop(L);
+}
+
+static int template_render (lua_State *L) {
+	int           have_stream, have_rope, locale;
+	char          digest[17];
+	lua_Integer   flush_after, max_bytes, deadline_ms, n, i;
+	render_t      r;
+	const char   *filename;
+	struct stat   statbuf;
+	luaL_Stream  *stream;
+	memstream_t  *memstream;
+
+	/* check arguments */
+	filename = luaL_checkstring(L, 1);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	have_stream = !lua_isnoneornil(L, 3);
+	if (have_stream) {
+		stream = luaL_checkudata(L, 3, LUA_FILEHANDLE);
+	}
+	memset(&r, 0, sizeof(render_t));
+	r.L = L;
+	memstream = NULL;
+	if (!lua_isnoneornil(L, 4)) {
+		luaL_checktype(L, 4, LUA_TTABLE);
+		lua_getfield(L, 4, "hash");
+		r.hashing = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+		lua_getfield(L, 4, "flush");
+		if (!lua_isnil(L, -1)) {
+			flush_after = luaL_checkinteger(L, -1);
+			if (flush_after < 0) {
+				return luaL_error(L, "bad flush option");
+			}
+			r.flush_after = (size_t)flush_after;
+		}
+		lua_pop(L, 1);
+		lua_getfield(L, 4, "max_bytes");
+		if (!lua_isnil(L, -1)) {
+			max_bytes = luaL_checkinteger(L, -1);
+			if (max_bytes <= 0) {
+				return luaL_error(L, "bad max_bytes option");
+			}
+			r.max_bytes = (size_t)max_bytes;
+		}
+		lua_pop(L, 1);
+		lua_getfield(L, 4, "deadline_ms");
+		if (!lua_isnil(L, -1)) {
+			deadline_ms = luaL_checkinteger(L, -1);
+			if (deadline_ms < 0) {
+				return luaL_error(L, "bad deadline_ms option");
+			}
+			r.deadline = template_clock() + deadline_ms;
+		}
+		lua_pop(L, 1);
+		lua_getfield(L, 4, "rope");
+		have_rope = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+		if (have_rope && have_stream) {
+			return luaL_error(L, "rope output cannot be combined with a file");
+		}
+	} else {
+		have_rope = 0;
+	}
+
+	/* get tracked dependencies, changed keys, the edge-side include option, and the locale */
+	lua_settop(L, 4);
+	r.deps = template_render_option(L, "track");
+	r.changed = template_render_option(L, "changed");
+	r.esi_option = template_render_option(L, "esi");
+	locale = template_render_option(L, "locale");
+	r.esi = lua_toboolean(L, r.esi_option);
+	if (lua_toboolean(L, r.deps)) {
+		r.tracking = 1;
+		if (!lua_istable(L, r.deps)) {
+			lua_newtable(L);
+			lua_replace(L, r.deps);
+		}
+	}
+	if (!lua_isnil(L, r.changed)) {
+		if (!r.tracking || !lua_istable(L, r.changed)) {
+			return luaL_error(L, "bad changed option");
+		}
+		if (have_stream || have_rope) {
+			return luaL_error(L, "changed option cannot be combined with a file or rope");
+		}
+		n = luaL_len(L, r.changed);
+		lua_createtable(L, 0, n);
+		for (i = 1; i <= n; i++) {
+			lua_geti(L, r.changed, i);
+			lua_pushboolean(L, 1);
+			lua_rawset(L, -3);
+		}
+		lua_replace(L, r.changed);
+	}
+	if (have_rope) {
+		r.rope = lua_newuserdata(L, sizeof(rope_t));
+		memset(r.rope, 0, sizeof(rope_t));
+		luaL_setmetatable(L, TEMPLATE_ROPE);
+		lua_newtable(L);
+		lua_setuservalue(L, -2);
+		lua_replace(L, 3);
+		r.rope->slices = list_create(sizeof(struct iovec), 16);
+		r.rope->chunks = list_create(sizeof(char *), 4);
+		if (!r.rope->slices || !r.rope->chunks) {
+			return luaL_error(L, "error allocating rope");
+		}
+		list_set_free(r.rope->chunks, 1);
+	} else if (!have_stream) {
+		memstream = lua_newuserdata(L, sizeof(memstream_t));
+		memstream->stream.closef = NULL;
+		memstream->str = NULL;
+		luaL_setmetatable(L, LUA_FILEHANDLE);
+		lua_replace(L, 3);
+		memstream->stream.f = open_memstream(&memstream->str, &memstream->len);
+		if (!memstream->stream.f) {
+			luaL_error(L, "error opening memory stream");
+		}
+		memstream->stream.closef = template_fclose;
+		stream = &memstream->stream;
+	}
+	if (!have_rope) {
+		r.f = stream->f;
+		r.flushing = have_stream;
+	}
+	r.start = -1;
+	if (have_stream && (r.max_bytes || r.deadline)) {
+		/* flush prior output, so a limit only resets the output of this rendering */
+		template_flush(&r);
+		r.start = ftello(r.f);
+		r.truncate = r.start >= 0 && fstat(fileno(r.f), &statbuf) == 0
+				&& S_ISREG(statbuf.st_mode) && statbuf.st_size <= r.start;
+	}
+	if (r.hashing) {
+		hash_init(&r.hash, 0);
+	}
+	
+	/* get templates registry */
+	template_templates(L);
+	r.templates = lua_gettop(L);
+
+	/* get escape cache, if any */
+	if (lua_getfield(L, LUA_REGISTRYINDEX, TEMPLATE_ESCAPES) == LUA_TUSERDATA) {
+		r.cache = lua_touserdata(L, -1);
+	}
+	r.escapes = lua_gettop(L);
+
+	/* get the message catalog of the locale, anchoring it in place of the locale */
+	if (!lua_isnil(L, locale)) {
+		lua_getfield(L, LUA_REGISTRYINDEX, TEMPLATE_CATALOGS);
+		if (lua_type(L, locale) != LUA_TSTRING || !lua_istable(L, -1)) {
+			return luaL_error(L, "bad locale option");
+		}
+		lua_pushvalue(L, locale);
+		if (lua_rawget(L, -2) != LUA_TUSERDATA) {
+			return luaL_error(L, "bad locale option");
+		}
+		r.catalog = lua_touserdata(L, -1);
+		lua_replace(L, locale);
+		lua_pop(L, 1);
+	}
+
+	/* resolve templates in advance with a batch resolver */
+	lua_getfield(L, LUA_REGISTRYINDEX, TEMPLATE_BATCH);
+	if (lua_toboolean(L, -1)) {
+		lua_pop(L, 1);
+		template_prefetch(L, r.templates, filename);
+	} else {
+		lua_pop(L, 1);
+	}
+
+	/* track environment access through a proxy, and collect patches */
+	if (r.tracking) {
+		lua_newtable(L);
+		lua_createtable(L, 0, 2);
+		lua_pushvalue(L, 2);
+		lua_pushnil(L);
+		lua_pushcclosure(L, template_track_index, 2);
+		lua_setfield(L, -2, "__index");
+		lua_pushvalue(L, 2);
+		lua_pushnil(L);
+		lua_pushcclosure(L, template_track_newindex, 2);
+		lua_setfield(L, -2, "__newindex");
+		lua_setmetatable(L, -2);
+		lua_replace(L, 2);
+		if (!lua_isnil(L, r.changed)) {
+			r.patching = memstream;
+			lua_newtable(L);
+			r.patches = lua_gettop(L);
+		}
+	}
+
+	/* render */
+	template_render_template(&r, filename, 1);
+
+	/* return result and hash, if any */
+	if (have_rope) {
+		lua_pushvalue(L, 3);
+	} else if (!have_stream) {
+		if (fclose(memstream->stream.f) != 0) {
+			return luaL_error(L, "error closing memory stream");
+		}
+		if (r.patching) {
+			lua_pushvalue(L, r.patches);
+		} else {
+			lua_pushlstring(L, memstream->str, memstream->len);
+		}
+		free(memstream->str);
+		memstream->stream.closef = NULL;
+	}
+	if (r.hashing) {
+		snprintf(digest, sizeof(digest), "%016" PRIx64, hash_final(&r.hash));
+		lua_pushstring(L, digest);
+	}
+	if (r.tracking) {
+		lua_pushvalue(L, r.deps);
+	}
+	return (have_stream ? 0 : 1) + (r.hashing ? 1 : 0) + (r.tracking ? 1 : 0);
+}
+
+
+/*
+ * library
+ */
+
+static int template_getresolver (lua_State *L) {
+	lua_getfield(L, LUA_REGISTRYINDEX, TEMPLATE_RESOLVER);
+	lua_createtable(L, 0, 1);
+	lua_getfield(L, LUA_REGISTRYINDEX, TEMPLATE_BATCH);
+	lua_pushboolean(L, lua_toboolean(L, -1));
+	lua_setfield(L, -3, "batch");
+	lua_pop(L, 1);
+	return 2;
+}
+
+static int template_setresolver (lua_State *L) {
+	if (!lua_isnoneornil(L, 1)) {
+		luaL_checktype(L, 1, LUA_TFUNCTION);
+	}
+	if (!lua_isnoneornil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TTABLE);
+		lua_getfield(L, 2, "batch");
+		lua_pushboolean(L, !lua_isnoneornil(L, 1) && lua_toboolean(L, -1));
+	} else {
+		lua_pushboolean(L, 0);
+	}
+	lua_setfield(L, LUA_REGISTRYINDEX, TEMPLATE_BATCH);
+	lua_settop(L, 1);
+	lua_setfield(L, LUA_REGISTRYINDEX, TEMPLATE_RESOLVER);
+	return 0;
+}
+
+static int template_setsources (lua_State *L) {
+	if (lua_isnoneornil(L, 1)) {
+		lua_pushnil(L);
+		lua_setfield(L, LUA_REGISTRYINDEX, TEMPLATE_SOURCES);
+		return 0;
+	}
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_settop(L, 1);
+	lua_newtable(L);
+	lua_pushnil(L);
+	while (lua_next(L, 1)) {
+		if (lua_type(L, -2) != LUA_TSTRING || lua_type(L, -1) != LUA_TSTRING) {
+			return luaL_error(L, "bad source");
+		}
+		lua_pushvalue(L, -2);
+		lua_insert(L, -2);
+		lua_rawset(L, 2);
+	}
+	lua_setfield(L, LUA_REGISTRYINDEX, TEMPLATE_SOURCES);
+	return 0;
+}
+
+static int template_setarchive (lua_State *L) {
+	int             fd;
+	char            name[TEMPLATE_MAX_NAME];
+	size_t          pos, len, name_len, prefix_len, long_len, sum, i;
+	member_t       *member;
+	archive_t      *archive;
+	struct stat     statbuf;
+	const char     *filename, *data, *long_name;
+	unsigned char  *header;
+
+	if (lua_isnoneornil(L, 1)) {
+		lua_pushnil(L);
+		lua_setfield(L, LUA_REGISTRYINDEX, TEMPLATE_PACK);
+		return 0;
+	}
+	filename = luaL_checkstring(L, 1);
+
+	/* map archive */
+	archive = lua_newuserdata(L, sizeof(archive_t));
+	memset(archive, 0, sizeof(archive_t));
+	luaL_setmetatable(L, TEMPLATE_ARCHIVE);
+	archive->members = table_create(64);
+	if (!archive->members) {
+		return luaL_error(L, "out of memory");
+	}
+	table_set_dup(archive->members, 1);
+	table_set_free(archive->members, 1);
+	fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return luaL_error(L, "%s: archive not found", filename);
+	}
+	if (fstat(fd, &statbuf) != 0 || statbuf.st_size == 0) {
+		close(fd);
+		return luaL_error(L, "%s: bad archive", filename);
+	}
+	archive->map = mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (archive->map == MAP_FAILED) {
+		archive->map = NULL;
+		return luaL_error(L, "%s: error mapping archive", filename);
+	}
+	archive->size = statbuf.st_size;
+
+	/* index the regular files of the tar archive */
+	pos = 0;
+	long_name = NULL;
+	long_len = 0;
+	while (pos + TEMPLATE_TAR_BLOCK <= archive->size) {
+		header = (unsigned char *)archive->map + pos;
+		if (header[0] == '\0') {
+			break;
+		}
+		sum = 0;
+		for (i = 0; i < TEMPLATE_TAR_BLOCK; i++) {
+			sum += i >= 148 && i < 156 ? ' ' : header[i];
+		}
+		if (sum != strtoul(template_tar_field(header + 148, 8, name), NULL, 8)) {
+			return luaL_error(L, "%s: bad archive checksum", filename);
+		}
+		len = strtoul(template_tar_field(header + 124, 12, name), NULL, 8);
+		if (pos + TEMPLATE_TAR_BLOCK + len > archive->size) {
+			return luaL_error(L, "%s: truncated archive", filename);
+		}
+		data = archive->map + pos + TEMPLATE_TAR_BLOCK;
+		switch (header[156]) {
+		case 'L':
+			/* GNU long name of the next member */
+			long_name = data;
+			long_len = strnlen(data, len);
+			break;
+
+		case 'x':
+			/* pax extended header; a path record names the next member */
+			if (template_tar_path(data, len, &long_name, &long_len) != 0) {
+				return luaL_error(L, "%s: bad archive extended header", filename);
+			}
+			break;
+
+		case '0':
+		case '\0':
+			if (long_name) {
+				if (long_len >= TEMPLATE_MAX_NAME) {
+					return luaL_error(L, "%s: archive member name too long", filename);
+				}
+				memcpy(name, long_name, long_len);
+				name[long_len] = '\0';
+			} else {
+				/* name is prefix '/' name for POSIX ustar; GNU tar uses the prefix field
+				 * for other data */
+				prefix_len = 0;
+				if (memcmp(header + 257, "ustar", 6) == 0) {
+					prefix_len = strnlen((char *)header + 345, 155);
+					memcpy(name, header + 345, prefix_len);
+					if (prefix_len > 0) {
+						name[prefix_len++] = '/';
+					}
+				}
+				name_len = strnlen((char *)header, 100);
+				memcpy(name + prefix_len, header, name_len);
+				name[prefix_len + name_len] = '\0';
+			}
+			member = malloc(sizeof(member_t));
+			if (!member) {
+				return luaL_error(L, "out of memory");
+			}
+			member->str = data;
+			member->len = len;
+			if (table_set(archive->members, strncmp(name, "./", 2) == 0 ? name + 2 : name,
+					member) != 0) {
+				free(member);
+				return luaL_error(L, "out of memory");
+			}
+			/* fall through */
+
+		default:
+			long_name = NULL;
+			long_len = 0;
+		}
+		pos += TEMPLATE_TAR_BLOCK + (len + TEMPLATE_TAR_BLOCK - 1) / TEMPLATE_TAR_BLOCK
+				* TEMPLATE_TAR_BLOCK;
+	}
+	lua_setfield(L, LUA_REGISTRYINDEX, TEMPLATE_PACK);
+	return 0;
+}
+
+static const char *template_tar_field (const unsigned char *field, size_t len, char *buf) {
+	/* copy a numeric header field, which may lack a terminator */
+	memcpy(buf, field, len);
+	buf[len] = '\0';
+	return buf;
+}
+
+static int template_tar_path (const char *data, size_t len, const char **path,
+		size_t *path_len) {
+	size_t       record_len;
+	const char  *end, *key, *record_end;
+
+	/* pax records are "length key=value\n", where the length covers the whole record */
+	end = data + len;
+	while (data < end && *data != '\0') {
+		record_len = 0;
+		for (key = data; key < end && *key >= '0' && *key <= '9'; key++) {
+			record_len = record_len * 10 + (*key - '0');
+			if (record_len > (size_t)(end - data)) {
+				return -1;
+			}
+		}
+		record_end = data + record_len;
+		if (key == data || key >= record_end || *key != ' ' || record_end[-1] != '\n') {
+			return -1;
+		}
+		key++;
+		if (record_end - key > 5 && memcmp(key, "path=", 5) == 0) {
+			*path = key + 5;
+			*path_len = record_end - 1 - *path;
+		}
+		data = record_end;
+	}
+	return 0;
+}
+
+static int template_archive_gc (lua_State *L) {
+	archive_t  *archive;
+
+	archive = luaL_checkudata(L, 1, TEMPLATE_ARCHIVE);
+	if (archive->members) {
+		table_free(archive->members);
+		archive->members = NULL;
+	}
+	if (archive->map) {
+		munmap(archive->map, archive->size);
+		archive->map = NULL;
+	}
+	return 0;
+}
+
+static int template_setcatalog (lua_State *L) {
+	int          found;
+	size_t       index, n, len;
+	catalog_t   *catalog;
+	message_t   *message;
+	const char  *str;
+
+	luaL_checkstring(L, 1);
+	if (!lua_isnoneornil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TTABLE);
+	}
+	lua_settop(L, 2);
+
+	/* get the catalogs, which list the bound locales in index order */
+	if (lua_getfield(L, LUA_REGISTRYINDEX, TEMPLATE_CATALOGS) != LUA_TTABLE) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, LUA_REGISTRYINDEX, TEMPLATE_CATALOGS);
+	}
+	n = lua_rawlen(L, 3);
+	for (index = 0; index < n; index++) {
+		lua_rawgeti(L, 3, index + 1);
+		found = lua_rawequal(L, 1, -1);
+		lua_pop(L, 1);
+		if (found) {
+			break;
+		}
+	}
+	if (index == n) {
+		lua_pushvalue(L, 1);
+		lua_rawseti(L, 3, n + 1);
+	}
+
+	/* load the messages */
+	lua_pushvalue(L, 1);
+	if (lua_isnil(L, 2)) {
+		lua_pushnil(L);
+	} else {
+		n = 0;
+		lua_pushnil(L);
+		while (lua_next(L, 2)) {
+			n++;
+			lua_pop(L, 1);
+		}
+		catalog = lua_newuserdata(L, sizeof(catalog_t));
+		catalog->index = index;
+		catalog->messages = NULL;
+		luaL_setmetatable(L, TEMPLATE_CATALOG);
+		catalog->messages = table_create(n);
+		if (!catalog->messages) {
+			return luaL_error(L, "out of memory");
+		}
+		table_set_dup(catalog->messages, 1);
+		table_set_free(catalog->messages, 1);
+		lua_pushnil(L);
+		while (lua_next(L, 2)) {
+			if (lua_type(L, -2) != LUA_TSTRING || lua_type(L, -1) != LUA_TSTRING) {
+				return luaL_error(L, "bad message");
+			}
+			str = lua_tolstring(L, -1, &len);
+			message = malloc(sizeof(message_t) + len);
+			if (!message) {
+				return luaL_error(L, "out of memory");
+			}
+			message->len = len;
+			memcpy(message->str, str, len);
+			if (table_set(catalog->messages, lua_tostring(L, -2), message) != 0) {
+				free(message);
+				return luaL_error(L, "out of memory");
+			}
+			lua_pop(L, 1);
+		}
+	}
+	lua_rawset(L, 3);
+
+	/* parse templates anew, as literal keys are resolved when parsing */
+	lua_pushnil(L);
+	lua_setfield(L, LUA_REGISTRYINDEX, TEMPLATE_TEMPLATES);
+	return 0;
+}
+
+static int template_catalog_gc (lua_State *L) {
+	catalog_t  *catalog;
+
+	catalog = luaL_checkudata(L, 1, TEMPLATE_CATALOG);
+	if (catalog->messages) {
+		table_free(catalog->messages);
+		catalog->messages = NULL;
+	}
+	return 0;
+}
+
+static int template_getminify (lua_State *L) {
+	lua_getfield(L, LUA_REGISTRYINDEX, TEMPLATE_MINIFY);
+	lua_pushboolean(L, lua_toboolean(L, -1));
+	return 1;
+}
+
+static int template_setminify (lua_State *L) {
+	luaL_checkany(L, 1);
+	lua_pushboolean(L, lua_toboolean(L, 1));
+	lua_setfield(L, LUA_REGISTRYINDEX, TEMPLATE_MINIFY);
+	return 0;
+}
+
+static int template_clear (lua_State *L) {
+	lua_pushnil(L);
+	lua_setfield(L, LUA_REGISTRYINDEX, TEMPLATE_TEMPLATES);
+	return 0;
+}
+
+static int template_variables (lua_State *L) {
+	int  complete;
+
+	luaL_checkstring(L, 1);
+	lua_settop(L, 1);
+
+	/* get templates registry */
+	template_templates(L);
+
+	/* collect the names read and assigned as indices 3 and 4, visiting each template once */
+	lua_newtable(L);
+	lua_newtable(L);
+	lua_newtable(L);
+	complete = template_variables_add(L, lua_tostring(L, 1), 3);
+	lua_pop(L, 1);
+	lua_pushboolean(L, complete);
+	return 3;
+}
+
+static int template_variables_add (lua_State *L, const char *filename, int index) {
+	int             complete;
+	size_t          i;
+	template_t     *t;
+	table_entry_t  *entry;
+
+	/* add the names to the read and assigned sets at index and index + 1; visited templates are
+	   at index + 2, and the templates registry is at 2 */
+	if (lua_getfield(L, index + 2, filename) != LUA_TNIL) {
+		lua_pop(L, 1);
+		return 1;
+	}
+	lua_pop(L, 1);
+	lua_pushboolean(L, 1);
+	lua_setfield(L, index + 2, filename);
+	luaL_checkstack(L, 2, NULL);
+	t = template_load(L, 2, filename);
+	for (i = 0; i < t->names->alloc; i++) {
+		entry = &t->names->entries[i];
+		if (entry->state != TES_SET) {
+			continue;
+		}
+		if ((uintptr_t)entry->value & TEMPLATE_VREAD) {
+			lua_pushboolean(L, 1);
+			lua_setfield(L, index, entry->key);
+		}
+		if ((uintptr_t)entry->value & TEMPLATE_VWRITE) {
+			lua_pushboolean(L, 1);
+			lua_setfield(L, index + 1, entry->key);
+		}
+	}
+	complete = !t->computed;
+	for (i = 0; i < t->includes->count; i++) {
+		if (!template_variables_add(L, *(const char **)list_get(t->includes, i), index)) {
+			complete = 0;
+		}
+	}
+	lua_pop(L, 1);
+	return complete;
+}
+
+static int template_newenv (lua_State *L) {
+	template_t  *t;
+	const char  *filename;
+
+	filename = luaL_checkstring(L, 1);
+	if (!lua_isnoneornil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TTABLE);
+	}
+	lua_settop(L, 2);
+
+	/* get templates registry as index 2, and the template */
+	template_templates(L);
+	lua_insert(L, 2);
+	t = template_load(L, 2, filename);
+
+	/* count the names of the template and its literal includes once */
+	if (t->env_size == 0) {
+		lua_newtable(L);
+		lua_newtable(L);
+		lua_newtable(L);
+		template_variables_add(L, filename, 5);
+		lua_pop(L, 1);
+		lua_pushnil(L);
+		while (lua_next(L, 5)) {
+			t->env_size++;
+			lua_pop(L, 1);
+		}
+		lua_pushnil(L);
+		while (lua_next(L, 6)) {
+			lua_pushvalue(L, -2);
+			if (lua_rawget(L, 5) == LUA_TNIL) {
+				t->env_size++;
+			}
+			lua_pop(L, 2);
+		}
+		lua_settop(L, 4);
+	}
+
+	/* create the environment, sharing one metatable per base */
+	lua_createtable(L, 0, t->env_size);
+	if (!lua_isnil(L, 3)) {
+		if (lua_getfield(L, LUA_REGISTRYINDEX, TEMPLATE_BASES) != LUA_TTABLE) {
+			lua_pop(L, 1);
+			lua_newtable(L);
+			lua_createtable(L, 0, 1);
+			lua_pushliteral(L, "k");
+			lua_setfield(L, -2, "__mode");
+			lua_setmetatable(L, -2);
+			lua_pushvalue(L, -1);
+			lua_setfield(L, LUA_REGISTRYINDEX, TEMPLATE_BASES);
+		}
+		lua_pushvalue(L, 3);
+		if (lua_rawget(L, -2) == LUA_TNIL) {
+			lua_pop(L, 1);
+			lua_createtable(L, 0, 1);
+			lua_pushvalue(L, 3);
+			lua_setfield(L, -2, "__index");
+			lua_pushvalue(L, 3);
+			lua_pushvalue(L, -2);
+			lua_rawset(L, -4);
+		}
+		lua_setmetatable(L, -3);
+		lua_pop(L, 1);
+	}
+	return 1;
+}
+
+static int template_getescapecache (lua_State *L) {
+	cache_t  *cache;
 
-	/* check arguments */
-	filename = luaL_checkstring(L, 1);
-	luaL_checktype(L, 2, LUA_TTABLE);
-	have_stream = lua_gettop(L) >= 3;
-	if (have_stream) {
-		stream = luaL_checkudata(L, 3, LUA_FILEHANDLE);
-		lua_settop(L, 3);
+	lua_getfield(L, LUA_REGISTRYINDEX, TEMPLATE_ESCAPES);
+	cache = luaL_testudata(L, -1, TEMPLATE_CACHE);
+	lua_pushinteger(L, cache ? (lua_Integer)cache->slots : 0);
+	return 1;
+}
+
+static int template_setescapecache (lua_State *L) {
+	int           bits;
+	cache_t      *cache;
+	lua_Integer   slots;
+
+	slots = luaL_checkinteger(L, 1);
+	luaL_argcheck(L, slots >= 0 && slots <= TEMPLATE_MAX_SLOTS, 1, "bad number of slots");
+	if (slots == 0) {
+		lua_pushnil(L);
+		lua_setfield(L, LUA_REGISTRYINDEX, TEMPLATE_ESCAPES);
+		return 0;
+	}
+	bits = 0;
+	while (((lua_Integer)1 << bits) < slots) {
+		bits++;
+	}
+	cache = lua_newuserdata(L, sizeof(cache_t));
+	memset(cache, 0, sizeof(cache_t));
+	luaL_setmetatable(L, TEMPLATE_CACHE);
+	cache->slots = (size_t)1 << bits;
+	cache->bits = bits;
+	cache->entries = calloc(TEMPLATE_NESC * cache->slots, sizeof(cache_entry_t));
+	if (!cache->entries) {
+		return luaL_error(L, "out of memory");
+	}
+	lua_createtable(L, TEMPLATE_NESC * cache->slots, 0);
+	lua_setuservalue(L, -2);
+	lua_setfield(L, LUA_REGISTRYINDEX, TEMPLATE_ESCAPES);
+	return 0;
+}
+
+static int template_cache_gc (lua_State *L) {
+	size_t    i;
+	cache_t  *cache;
+
+	cache = luaL_checkudata(L, 1, TEMPLATE_CACHE);
+	if (cache->entries) {
+		for (i = 0; i < TEMPLATE_NESC * cache->slots; i++) {
+			free(cache->entries[i].escaped);
+		}
+		free(cache->entries);
+	}
+	return 0;
+}
+
+static int template_safe (lua_State *L) {
+	luaL_checkstring(L, 1);
+	lua_settop(L, 1);
+	lua_newuserdata(L, 0);
+	luaL_setmetatable(L, TEMPLATE_SAFE);
+	lua_pushvalue(L, 1);
+	lua_setuservalue(L, -2);
+	return 1;
+}
+
+static void template_escape_value (lua_State *L, int index, int flags) {
+	size_t       len;
+	render_t     r;
+	luaL_Buffer  b;
+	const char  *str;
+
+	/* push the string at index escaped, collecting the output in a Lua buffer */
+	str = lua_tolstring(L, index, &len);
+	memset(&r, 0, sizeof(render_t));
+	r.L = L;
+	r.buffer = &b;
+	luaL_buffinit(L, &b);
+	template_output(&r, str, len, flags);
+	luaL_pushresult(&b);
+}
+
+static int template_escapestring (lua_State *L) {
+	int  flags;
+
+	luaL_checkstring(L, 1);
+	flags = TEMPLATE_FESCXML + luaL_checkoption(L, 2, "x", template_escape_letters);
+	template_escape_value(L, 1, flags);
+	return 1;
+}
+
+static int template_escapeall (lua_State *L) {
+	int          flags;
+	lua_Integer  n, i;
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	flags = TEMPLATE_FESCXML + luaL_checkoption(L, 2, "x", template_escape_letters);
+	lua_settop(L, 1);
+	n = lua_rawlen(L, 1);
+	for (i = 1; i <= n; i++) {
+		if (lua_rawgeti(L, 1, i) == LUA_TSTRING) {
+			template_escape_value(L, 2, flags);
+			lua_rawseti(L, 1, i);
+		}
+		lua_pop(L, 1);
+	}
+	return 1;
+}
+
+static int template_safe_tostring (lua_State *L) {
+	luaL_checkudata(L, 1, TEMPLATE_SAFE);
+	lua_getuservalue(L, 1);
+	return 1;
+}
+
+static int template_dataset (lua_State *L) {
+	dataset_t  *ds;
+
+	lua_settop(L, 2);
+	ds = lua_newuserdata(L, sizeof(dataset_t));
+	memset(ds, 0, sizeof(dataset_t));
+	luaL_setmetatable(L, TEMPLATE_DATASET);
+	lua_newtable(L);
+	lua_pushvalue(L, -2);
+	lua_rawseti(L, -2, 0);
+	lua_setuservalue(L, -2);
+	if (lua_type(L, 1) == LUA_TSTRING) {
+		template_dataset_file(L, ds);
 	} else {
-		memstream = lua_newuserdata(L, sizeof(memstream_t));
-		memstream->stream.closef = NULL;
-		memstream->str = NULL;
-		luaL_setmetatable(L, LUA_FILEHANDLE);
-		memstream->stream.f = open_memstream(&memstream->str, &memstream->len);
-		if (!memstream->stream.f) {
-			luaL_error(L, "error opening memory stream");
+		luaL_checktype(L, 1, LUA_TTABLE);
+		template_dataset_table(L, ds);
+	}
+	return 1;
+}
+
+static void template_dataset_columns (lua_State *L, dataset_t *ds, size_t count) {
+	ds->columns = calloc(count > 0 ? count : 1, sizeof(column_t));
+	if (!ds->columns) {
+		luaL_error(L, "out of memory");
+	}
+}
+
+static void template_dataset_alloc (lua_State *L, dataset_t *ds, column_t *column,
+		size_t data_len) {
+	/* allocate column storage for all rows; strings are stored as offsets into one buffer */
+	column->nils = calloc(ds->rows > 0 ? ds->rows : 1, 1);
+	switch (column->type) {
+	case DT_INTEGER:
+		column->integers = malloc((ds->rows > 0 ? ds->rows : 1) * sizeof(lua_Integer));
+		if (!column->nils || !column->integers) {
+			luaL_error(L, "out of memory");
 		}
-		memstream->stream.closef = template_fclose;
-		stream = &memstream->stream;
+		break;
+
+	case DT_FLOAT:
+		column->floats = malloc((ds->rows > 0 ? ds->rows : 1) * sizeof(lua_Number));
+		if (!column->nils || !column->floats) {
+			luaL_error(L, "out of memory");
+		}
+		break;
+
+	default:
+		column->offsets = malloc((ds->rows + 1) * sizeof(size_t));
+		column->data = malloc(data_len > 0 ? data_len : 1);
+		if (!column->nils || !column->offsets || !column->data) {
+			luaL_error(L, "out of memory");
+		}
+		column->offsets[0] = 0;
+		break;
 	}
-	
-	/* get templates registry */
-	if (lua_getfield(L, LUA_REGISTRYINDEX, TEMPLATE_TEMPLATES) != LUA_TTABLE) {
+}
+
+static void template_dataset_name (lua_State *L, dataset_t *ds, size_t index) {
+	/* map the column name on the stack top to its index; the dataset is at index 3 */
+	lua_getuservalue(L, 3);
+	lua_pushvalue(L, -2);
+	if (lua_rawget(L, -2) != LUA_TNIL) {
+		luaL_error(L, "duplicate column '%s'", lua_tostring(L, -3));
+	}
+	lua_pop(L, 1);
+	lua_pushvalue(L, -2);
+	lua_pushinteger(L, (lua_Integer)index);
+	lua_rawset(L, -3);
+	lua_pop(L, 1);
+	ds->columns[index].name = lua_tolstring(L, -1, &ds->columns[index].name_len);
+}
+
+static void template_dataset_table (lua_State *L, dataset_t *ds) {
+	int          type, strings, numbers;
+	size_t       count, row, len, data_len;
+	column_t    *column;
+	lua_Integer  n;
+	const char  *str;
+
+	/* count columns and rows */
+	count = 0;
+	lua_pushnil(L);
+	while (lua_next(L, 1)) {
+		if (lua_type(L, -2) != LUA_TSTRING || !lua_istable(L, -1)) {
+			luaL_error(L, "bad column");
+		}
+		n = luaL_len(L, -1);
+		if (n > 0 && (size_t)n > ds->rows) {
+			ds->rows = (size_t)n;
+		}
+		count++;
 		lua_pop(L, 1);
-		lua_newtable(L);
-		lua_pushvalue(L, -1);
-		lua_setfield(L, LUA_REGISTRYINDEX, TEMPLATE_TEMPLATES);
 	}
+	template_dataset_columns(L, ds, count);
 
-	/* render */
-	template_render_template(L, stream->f, filename, 1);
+	/* build columns */
+	lua_pushnil(L);
+	while (lua_next(L, 1)) {
+		/* infer type */
+		column = &ds->columns[ds->count];
+		column->type = DT_INTEGER;
+		strings = numbers = 0;
+		data_len = 0;
+		for (row = 0; row < ds->rows; row++) {
+			type = lua_rawgeti(L, -1, row + 1);
+			if (type == LUA_TSTRING) {
+				lua_tolstring(L, -1, &len);
+				data_len += len;
+				strings = 1;
+			} else if (type == LUA_TNUMBER) {
+				if (!lua_isinteger(L, -1)) {
+					column->type = DT_FLOAT;
+				}
+				numbers = 1;
+			} else if (type != LUA_TNIL) {
+				luaL_error(L, "bad value in column '%s'", lua_tostring(L, -3));
+			}
+			lua_pop(L, 1);
+		}
+		if (strings && numbers) {
+			luaL_error(L, "mixed types in column '%s'", lua_tostring(L, -2));
+		}
+		if (strings) {
+			column->type = DT_STRING;
+		}
 
-	/* return result, if any */
-	if (have_stream) {
-		return 0;
+		/* store values */
+		ds->count++;
+		template_dataset_alloc(L, ds, column, data_len);
+		for (row = 0; row < ds->rows; row++) {
+			if (lua_rawgeti(L, -1, row + 1) == LUA_TNIL) {
+				column->nils[row] = 1;
+			}
+			switch (column->type) {
+			case DT_INTEGER:
+				column->integers[row] = lua_tointeger(L, -1);
+				break;
+
+			case DT_FLOAT:
+				column->floats[row] = lua_tonumber(L, -1);
+				break;
+
+			default:
+				len = 0;
+				if (!column->nils[row]) {
+					str = lua_tolstring(L, -1, &len);
+					memcpy(column->data + column->offsets[row], str, len);
+				}
+				column->offsets[row + 1] = column->offsets[row] + len;
+				break;
+			}
+			lua_pop(L, 1);
+		}
+		lua_pop(L, 1);
+		template_dataset_name(L, ds, ds->count - 1);
+	}
+}
+
+static const char *template_dataset_field (const char **pos, const char *end, int sep,
+		size_t *len) {
+	const char  *field, *c;
+
+	/* return the next field of the current line, advancing past its separator */
+	field = *pos;
+	for (c = field; c < end && *c != sep && *c != '\n'; c++);
+	*len = c - field;
+	if (*len > 0 && field[*len - 1] == '\r' && (c == end || *c == '\n')) {
+		(*len)--;
+	}
+	*pos = c < end && *c == sep ? c + 1 : c;
+	return field;
+}
+
+static data_type_e template_dataset_type (const char *field, size_t len) {
+	int          isfloat;
+	char         buf[TEMPLATE_MAX_VALUE];
+	size_t       digits, n;
+	const char  *c;
+
+	/* infer the type of a field */
+	if (len == 0 || len >= sizeof(buf)) {
+		return len == 0 ? DT_NONE : DT_STRING;
+	}
+	memcpy(buf, field, len);
+	buf[len] = '\0';
+
+	/* accept plain decimal syntax only: sign, digits, fraction, and exponent */
+	c = buf;
+	if (*c == '-' || *c == '+') {
+		c++;
+	}
+	digits = strspn(c, "0123456789");
+	c += digits;
+	isfloat = 0;
+	if (*c == '.') {
+		c++;
+		n = strspn(c, "0123456789");
+		digits += n;
+		c += n;
+		isfloat = 1;
+	}
+	if (digits == 0) {
+		return DT_STRING;
+	}
+	if (*c == 'e' || *c == 'E') {
+		c++;
+		if (*c == '-' || *c == '+') {
+			c++;
+		}
+		n = strspn(c, "0123456789");
+		if (n == 0) {
+			return DT_STRING;
+		}
+		c += n;
+		isfloat = 1;
+	}
+	if (*c != '\0') {
+		return DT_STRING;
+	}
+
+	/* values out of range remain strings */
+	errno = 0;
+	if (isfloat) {
+		strtod(buf, NULL);
 	} else {
-		if (fclose(memstream->stream.f) != 0) {
-			return luaL_error(L, "error closing memory stream");
+		strtoll(buf, NULL, 10);
+	}
+	if (errno == ERANGE) {
+		return DT_STRING;
+	}
+	return isfloat ? DT_FLOAT : DT_INTEGER;
+}
+
+static void template_dataset_file (lua_State *L, dataset_t *ds) {
+	int           sep;
+	char          buf[TEMPLATE_MAX_VALUE];
+	data_type_e   type;
+	size_t        count, index, row, len, size, *data_lens;
+	column_t     *column;
+	luaL_Buffer   b;
+	luaL_Stream  *stream;
+	const char   *filename, *str, *end, *pos, *line, *field;
+
+	/* read file */
+	filename = lua_tostring(L, 1);
+	str = luaL_optstring(L, 2, ",");
+	if (strlen(str) != 1) {
+		luaL_argerror(L, 2, "bad separator");
+	}
+	sep = (unsigned char)str[0];
+
+	/* open file as a Lua stream, so it is closed if an error occurs */
+	stream = lua_newuserdata(L, sizeof(luaL_Stream));
+	stream->closef = NULL;
+	luaL_setmetatable(L, LUA_FILEHANDLE);
+	stream->f = fopen(filename, "r");
+	if (!stream->f) {
+		luaL_error(L, "%s: file not found", filename);
+	}
+	stream->closef = template_rawclose;
+	luaL_buffinit(L, &b);
+	do {
+		len = fread(luaL_prepbuffsize(&b, TEMPLATE_RAW_BUFFER), 1, TEMPLATE_RAW_BUFFER,
+				stream->f);
+		luaL_addsize(&b, len);
+	} while (len == TEMPLATE_RAW_BUFFER);
+	if (ferror(stream->f)) {
+		luaL_error(L, "%s: error reading file", filename);
+	}
+	stream->closef = NULL;
+	if (fclose(stream->f) != 0) {
+		luaL_error(L, "%s: error closing file", filename);
+	}
+	luaL_pushresult(&b);
+	lua_remove(L, -2);
+	str = lua_tolstring(L, -1, &size);
+	end = str + size;
+
+	/* parse header */
+	pos = str;
+	count = 0;
+	do {
+		template_dataset_field(&pos, end, sep, &len);
+		count++;
+	} while (pos < end && *pos != '\n');
+	template_dataset_columns(L, ds, count);
+	data_lens = lua_newuserdata(L, count * sizeof(size_t));
+	memset(data_lens, 0, count * sizeof(size_t));
+	for (index = 0; index < count; index++) {
+		ds->columns[index].type = DT_NONE;
+	}
+
+	/* count rows and infer types */
+	line = pos < end ? pos + 1 : end;
+	for (pos = line; pos < end; pos = pos < end ? pos + 1 : end) {
+		if (*pos == '\n' || (*pos == '\r' && pos + 1 < end && pos[1] == '\n')) {
+			pos += *pos == '\r';
+			continue;
 		}
-		lua_pushlstring(L, memstream->str, memstream->len);
-		free(memstream->str);
-		memstream->stream.closef = NULL;
-		return 1;
+		index = 0;
+		do {
+			if (index == count) {
+				luaL_error(L, "%s: row %d: too many fields", filename, (int)ds->rows + 1);
+			}
+			field = template_dataset_field(&pos, end, sep, &len);
+			column = &ds->columns[index];
+			type = template_dataset_type(field, len);
+			if (type > column->type) {
+				column->type = type;
+			}
+			data_lens[index] += len;
+			index++;
+		} while (pos < end && *pos != '\n');
+		ds->rows++;
+	}
+
+	/* allocate and fill columns */
+	for (index = 0; index < count; index++) {
+		column = &ds->columns[index];
+		if (column->type == DT_NONE) {
+			column->type = DT_STRING;
+		}
+		ds->count++;
+		template_dataset_alloc(L, ds, column, data_lens[index]);
+	}
+	row = 0;
+	for (pos = line; pos < end; pos = pos < end ? pos + 1 : end) {
+		if (*pos == '\n' || (*pos == '\r' && pos + 1 < end && pos[1] == '\n')) {
+			pos += *pos == '\r';
+			continue;
+		}
+		index = 0;
+		do {
+			field = template_dataset_field(&pos, end, sep, &len);
+			template_dataset_set(ds, index, row, field, len, buf);
+			index++;
+		} while (pos < end && *pos != '\n');
+		while (index < count) {
+			template_dataset_set(ds, index, row, NULL, 0, buf);
+			index++;
+		}
+		row++;
+	}
+	lua_pop(L, 1);
+
+	/* map names */
+	pos = str;
+	for (index = 0; index < count; index++) {
+		field = template_dataset_field(&pos, end, sep, &len);
+		lua_pushlstring(L, field, len);
+		template_dataset_name(L, ds, index);
+		lua_pop(L, 1);
 	}
+	lua_pop(L, 1);
 }
 
+static void template_dataset_set (dataset_t *ds, size_t index, size_t row, const char *field,
+		size_t len, char *buf) {
+	column_t  *column;
 
-/*
- * library
- */
+	column = &ds->columns[index];
+	if (column->type == DT_STRING) {
+		if (len > 0) {
+			memcpy(column->data + column->offsets[row], field, len);
+		}
+		column->offsets[row + 1] = column->offsets[row] + len;
+		return;
+	}
+	if (len == 0) {
+		column->nils[row] = 1;
+		return;
+	}
+	memcpy(buf, field, len);
+	buf[len] = '\0';
+	if (column->type == DT_INTEGER) {
+		column->integers[row] = strtoll(buf, NULL, 10);
+	} else {
+		column->floats[row] = strtod(buf, NULL);
+	}
+}
 
-static int template_getresolver (lua_State *L) {
-	lua_getfield(L, LUA_REGISTRYINDEX, TEMPLATE_RESOLVER);
+static int template_dataset_len (lua_State *L) {
+	dataset_t  *ds;
+
+	ds = luaL_checkudata(L, 1, TEMPLATE_DATASET);
+	lua_pushinteger(L, (lua_Integer)ds->rows);
 	return 1;
 }
 
-static int template_setresolver (lua_State *L) {
-	if (!lua_isnoneornil(L, 1)) {
-		luaL_checktype(L, 1, LUA_TFUNCTION);
+static int template_dataset_gc (lua_State *L) {
+	size_t      i;
+	column_t   *column;
+	dataset_t  *ds;
+
+	ds = luaL_checkudata(L, 1, TEMPLATE_DATASET);
+	if (ds->columns) {
+		for (i = 0; i < ds->count; i++) {
+			column = &ds->columns[i];
+			free(column->nils);
+			switch (column->type) {
+			case DT_INTEGER:
+				free(column->integers);
+				break;
+
+			case DT_FLOAT:
+				free(column->floats);
+				break;
+
+			default:
+				free(column->offsets);
+				free(column->data);
+				break;
+			}
+		}
+		free(ds->columns);
+		ds->columns = NULL;
 	}
-	lua_settop(L, 1);
-	lua_setfield(L, LUA_REGISTRYINDEX, TEMPLATE_RESOLVER);
 	return 0;
 }
 
-static int template_clear (lua_State *L) {
-	lua_pushnil(L);
-	lua_setfield(L, LUA_REGISTRYINDEX, TEMPLATE_TEMPLATES);
+static int template_row_index (lua_State *L) {
+	size_t       len;
+	row_t       *row;
+	column_t    *column;
+	dataset_t   *ds;
+	const char  *name;
+
+	/* the uservalue of the row maps column names to indexes, and indexes to string cells */
+	row = luaL_checkudata(L, 1, TEMPLATE_ROW);
+	ds = row->ds;
+	if (lua_type(L, 2) != LUA_TSTRING) {
+		lua_pushnil(L);
+		return 1;
+	}
+	name = lua_tolstring(L, 2, &len);
+
+	/* look up the column index by name, unless the column is the same as last time */
+	column = row->column < ds->count ? &ds->columns[row->column] : NULL;
+	if (!column || column->name_len != len || memcmp(column->name, name, len) != 0) {
+		lua_getuservalue(L, 1);
+		lua_pushvalue(L, 2);
+		if (lua_rawget(L, -2) != LUA_TNUMBER) {
+			lua_pushnil(L);
+			return 1;
+		}
+		row->column = (size_t)lua_tointeger(L, -1);
+		column = &ds->columns[row->column];
+		lua_pop(L, 2);
+	}
+
+	/* read the value of the current row */
+	if (column->nils[row->row]) {
+		lua_pushnil(L);
+		return 1;
+	}
+	switch (column->type) {
+	case DT_INTEGER:
+		lua_pushinteger(L, column->integers[row->row]);
+		break;
+
+	case DT_FLOAT:
+		lua_pushnumber(L, column->floats[row->row]);
+		break;
+
+	default:
+		/* string cells are created once, and then kept with the dataset */
+		lua_getuservalue(L, 1);
+		if (lua_rawgeti(L, -1, (lua_Integer)row->column + 1) != LUA_TTABLE) {
+			lua_pop(L, 1);
+			lua_createtable(L, ds->rows <= INT_MAX ? (int)ds->rows : 0, 0);
+			lua_pushvalue(L, -1);
+			lua_rawseti(L, -3, (lua_Integer)row->column + 1);
+		}
+		if (lua_rawgeti(L, -1, (lua_Integer)row->row + 1) == LUA_TNIL) {
+			lua_pop(L, 1);
+			lua_pushlstring(L, column->data + column->offsets[row->row],
+					column->offsets[row->row + 1] - column->offsets[row->row]);
+			lua_pushvalue(L, -1);
+			lua_rawseti(L, -3, (lua_Integer)row->row + 1);
+		}
+	}
+	return 1;
+}
+
+static int template_rope_len (lua_State *L) {
+	rope_t  *rope;
+
+	rope = luaL_checkudata(L, 1, TEMPLATE_ROPE);
+	lua_pushinteger(L, (lua_Integer)rope->len);
+	return 1;
+}
+
+static int template_rope_tostring (lua_State *L) {
+	char          *str;
+	size_t         i;
+	rope_t        *rope;
+	luaL_Buffer    b;
+	struct iovec  *slice;
+
+	rope = luaL_checkudata(L, 1, TEMPLATE_ROPE);
+	str = luaL_buffinitsize(L, &b, rope->len);
+	for (i = 0; i < rope->slices->count; i++) {
+		slice = list_get(rope->slices, i);
+		memcpy(str, slice->iov_base, slice->iov_len);
+		str += slice->iov_len;
+	}
+	luaL_pushresultsize(&b, rope->len);
+	return 1;
+}
+
+static int template_rope_totable (lua_State *L) {
+	size_t         i;
+	rope_t        *rope;
+	struct iovec  *slice;
+
+	rope = luaL_checkudata(L, 1, TEMPLATE_ROPE);
+	lua_createtable(L, rope->slices->count, 0);
+	for (i = 0; i < rope->slices->count; i++) {
+		slice = list_get(rope->slices, i);
+		lua_pushlstring(L, slice->iov_base, slice->iov_len);
+		lua_rawseti(L, -2, i + 1);
+	}
+	return 1;
+}
+
+static int template_rope_iovecs (lua_State *L) {
+	rope_t  *rope;
+
+	rope = luaL_checkudata(L, 1, TEMPLATE_ROPE);
+	lua_pushlightuserdata(L, rope->slices->entries);
+	lua_pushinteger(L, (lua_Integer)rope->slices->count);
+	return 2;
+}
+
+static int template_rope_gc (lua_State *L) {
+	rope_t  *rope;
+
+	rope = luaL_checkudata(L, 1, TEMPLATE_ROPE);
+	if (rope->slices) {
+		list_free(rope->slices);
+		rope->slices = NULL;
+	}
+	if (rope->chunks) {
+		list_free(rope->chunks);
+		rope->chunks = NULL;
+	}
 	return 0;
 }
 
@@ -1319,7 +4718,26 @@ int luaopen_template (lua_State *L) {
 		{"render", template_render},
 		{"getresolver", template_getresolver},
 		{"setresolver", template_setresolver},
+		{"setsources", template_setsources},
+		{"setarchive", template_setarchive},
+		{"setcatalog", template_setcatalog},
+		{"getminify", template_getminify},
+		{"setminify", template_setminify},
 		{"clear", template_clear},
+		{"variables", template_variables},
+		{"newenv", template_newenv},
+		{"getescapecache", template_getescapecache},
+		{"setescapecache", template_setescapecache},
+		{"safe", template_safe},
+		{"escape", template_escapestring},
+		{"escapeall", template_escapeall},
+		{"dataset", template_dataset},
+		{NULL, NULL}
+	};
+	static luaL_Reg template_rope_methods[] = {
+		{"tostring", template_rope_tostring},
+		{"totable", template_rope_totable},
+		{"iovecs", template_rope_iovecs},
 		{NULL, NULL}
 	};
 
@@ -1340,5 +4758,53 @@ int luaopen_template (lua_State *L) {
 	lua_setfield(L, -2, "__gc");
 	lua_pop(L, 1);
 
+	/* archive */
+	luaL_newmetatable(L, TEMPLATE_ARCHIVE);
+	lua_pushcfunction(L, template_archive_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_pop(L, 1);
+
+	/* message catalog */
+	luaL_newmetatable(L, TEMPLATE_CATALOG);
+	lua_pushcfunction(L, template_catalog_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_pop(L, 1);
+
+	/* escape cache */
+	luaL_newmetatable(L, TEMPLATE_CACHE);
+	lua_pushcfunction(L, template_cache_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_pop(L, 1);
+
+	/* dataset */
+	luaL_newmetatable(L, TEMPLATE_DATASET);
+	lua_pushcfunction(L, template_dataset_len);
+	lua_setfield(L, -2, "__len");
+	lua_pushcfunction(L, template_dataset_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_pop(L, 1);
+	luaL_newmetatable(L, TEMPLATE_ROW);
+	lua_pushcfunction(L, template_row_index);
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+
+	/* rope */
+	luaL_newmetatable(L, TEMPLATE_ROPE);
+	luaL_newlib(L, template_rope_methods);
+	lua_setfield(L, -2, "__index");
+	lua_pushcfunction(L, template_rope_len);
+	lua_setfield(L, -2, "__len");
+	lua_pushcfunction(L, template_rope_tostring);
+	lua_setfield(L, -2, "__tostring");
+	lua_pushcfunction(L, template_rope_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_pop(L, 1);
+
+	/* safe string */
+	luaL_newmetatable(L, TEMPLATE_SAFE);
+	lua_pushcfunction(L, template_safe_tostring);
+	lua_setfield(L, -2, "__tostring");
+	lua_pop(L, 1);
+
 	return 1;
 }
@@ -15,7 +15,21 @@
 #define TEMPLATE_PARSER     "template.parser"     /* parser metatable */
 #define TEMPLATE_TEMPLATE   "template.template"   /* template metatable */
 #define TEMPLATE_TEMPLATES  "template.templates"  /* loaded templates */
+#define TEMPLATE_SAFE       "template.safe"       /* safe string metatable */
+#define TEMPLATE_CACHE      "template.cache"      /* escape cache metatable */
+#define TEMPLATE_DATASET    "template.dataset"    /* dataset metatable */
+#define TEMPLATE_ROW        "template.row"        /* dataset row metatable */
+#define TEMPLATE_ROPE       "template.rope"       /* rope metatable */
+#define TEMPLATE_ESCAPES    "template.escapes"    /* escape cache */
 #define TEMPLATE_RESOLVER   "template.resolver"   /* resolver function */
+#define TEMPLATE_BATCH      "template.batch"      /* batch resolver flag */
+#define TEMPLATE_SOURCES    "template.sources"    /* registered sources */
+#define TEMPLATE_ARCHIVE    "template.archive"    /* archive metatable */
+#define TEMPLATE_PACK       "template.pack"       /* archive */
+#define TEMPLATE_CATALOG    "template.catalog"    /* message catalog metatable */
+#define TEMPLATE_CATALOGS   "template.catalogs"   /* message catalogs by locale */
+#define TEMPLATE_BASES      "template.bases"      /* environment metatables by base */
+#define TEMPLATE_MINIFY     "template.minify"     /* minify flag */
 
 
 int luaopen_template(lua_State *L);
@@ -8,6 +8,7 @@ assert(type(template.getresolver()) == "function")
 assert(template.render("test/test.txt", _G) == "Test2")
 template.setresolver(nil)
 assert(type(template.getresolver()) == "nil")
+assert(select(2, template.getresolver()).batch == false)
 template.clear()
 assert(template.render("test/test.txt", _G) == "Test\n")
 
@@ -26,6 +27,13 @@ local TEMPLATES = {
 	test_sub_xml = "$[x]{xml}",
 	test_sub_url = "$[u]{url}",
 	test_sub_js = "$[j]{js}",
+	test_trim = "<ul>\n\t<l:for names=\"_, value\" in=\"ipairs(values)\" ->\n\t<li>${- value -}  </li>"
+			.. "\n\t<-/l:for>\n</ul>",
+	test_trim_else = "<l:if cond=\"cond\">\n\tTrue\n<-l:else -/>\n\tFalse\n</l:if>",
+	test_trim_sub = "a $[n]{- -value -} b ${ value - 1 }",
+	test_minify = "<ul>\n\t<l:for names=\"_, value\" in=\"ipairs(values)\">\n\t<li>${value}  !</li>"
+			.. "</l:for>\n</ul>",
+	test_minify_pre = "<div>\n\t<PRE class=\"x\">\n a  ${value}\n</pre>\n</div>\n",
 }
 template.setresolver(function (key) return TEMPLATES[key] end)
 
@@ -56,3 +64,485 @@ test("test_sub_nilsup", { }, "")
 test("test_sub_xml", { xml = "<test>" }, "&lt;test&gt;")
 test("test_sub_url", { url = "a/b?c" }, "a%2Fb%3Fc")
 test("test_sub_js", { js = "'a'" }, "\\'a\\'")
+
+-- Test whitespace trimming
+test("test_trim", { values = { 1, 2 } }, "<ul>\n\t<li>1</li><li>2</li>\n</ul>")
+test("test_trim_else", { cond = true }, "\n\tTrue")
+test("test_trim_else", { cond = false }, "False\n")
+test("test_trim_sub", { value = 2 }, "a-2b 1")
+TEMPLATES.test_trim_minus = "(${- value}|${-value}|${(- value)})"
+test("test_trim_minus", { value = 5 }, "(5|-5|-5)")
+
+-- Test minification
+assert(template.getminify() == false)
+template.setminify(true)
+assert(template.getminify() == true)
+template.clear()
+test("test_minify", { values = { 1, 2 } }, "<ul><li>1 !</li><li>2 !</li></ul>")
+test("test_minify_pre", { value = 1 }, "<div><PRE class=\"x\">\n a  1\n</pre></div>")
+template.setminify(false)
+template.clear()
+test("test_minify", { values = { 1 } }, "<ul>\n\t\n\t<li>1  !</li>\n</ul>")
+
+-- Test output hash
+local output, hash = template.render("test_for", setmetatable({ values = { 1, 2, 3 } },
+		{ __index = _G }), nil, { hash = true })
+assert(output == "123")
+assert(hash == "3c697d223fa7e885")
+local file = io.tmpfile()
+hash = template.render("test_sub_xml", setmetatable({ xml = "<test>" }, { __index = _G }), file,
+		{ hash = true })
+file:seek("set")
+assert(file:read("a") == "&lt;test&gt;")
+file:close()
+assert(hash == "8fdbd00b99d21c9a")
+
+-- Test number and type substitution
+for _, value in ipairs({ 0, 7, 42, -42, 1234567890, math.maxinteger, math.mininteger, 0.1, -2.5,
+		3.0, -0.0, 1e100, 1 / 3, 1 / 0, -1 / 0 }) do
+	test("test_sub_xml", { xml = value }, tostring(value))
+end
+test("test_sub_xml", { xml = true }, "(boolean)")
+test("test_sub_xml", { xml = { } }, "(table)")
+test("test_sub_url", { url = -1.5 }, "-1.5")
+
+-- Test embedded zeros and non-ASCII characters
+test("test_sub_nilsup", { undefined = "a\0<b>" }, "a\0<b>")
+test("test_sub_xml", { xml = "a\0<b>" }, "a\0&lt;b&gt;")
+test("test_sub_url", { url = "\0\xc3\xa4 " }, "%00%C3%A4%20")
+test("test_sub_js", { js = "a\0\"\n" }, "a\0\\\"\\n")
+
+-- Test JSON serialization
+TEMPLATES.test_sub_json = "$[J]{value}"
+TEMPLATES.test_sub_json_xml = "$[Jx]{value}"
+TEMPLATES.test_sub_json_nilsup = "$[Jn]{value}"
+test("test_sub_json", { }, "null")
+test("test_sub_json_nilsup", { }, "")
+test("test_sub_json", { value = { 1, 2.5, true, false, "a\"b\\c\n\1</script>\xe2\x80\xa8" } },
+		"[1,2.5,true,false,\"a\\\"b\\\\c\\n\\u0001<\\/script>\\u2028\"]")
+test("test_sub_json", { value = { a = { } } }, "{\"a\":{}}")
+test("test_sub_json", { value = { [2] = 0 / 0 } }, "{\"2\":null}")
+test("test_sub_json_xml", { value = { "<" } }, "[&quot;&lt;&quot;]")
+local json = template.render("test_sub_json", { value = { 1, nil, 3, x = 1 } })
+assert(json:sub(1, 1) == "{" and json:find("\"x\":1", 1, true) and json:find("\"3\":3", 1, true))
+assert(not pcall(template.render, "test_sub_json", { value = { print } }))
+local nested = { }
+nested[1] = nested
+assert(not pcall(template.render, "test_sub_json", { value = nested }))
+
+-- Test number formatting
+TEMPLATES.test_sub_format = "$[x,format=%.2f]{value}"
+TEMPLATES.test_sub_format_int = "$[format=\"#%05d, \"]{value}"
+test("test_sub_format", { value = 3.14159 }, "3.14")
+test("test_sub_format", { value = 2 }, "2.00")
+test("test_sub_format", { value = "1.5" }, "1.50")
+test("test_sub_format", { value = true }, "(boolean)")
+test("test_sub_format_int", { value = 42 }, "#00042, ")
+test("test_sub_format_int", { value = 42.0 }, "#00042, ")
+assert(not pcall(template.render, "test_sub_format_int", { value = 4.2 }))
+for _, format in ipairs({ "%d%d", "%s", "%100d", "%100.2f", "%99999.2f", "%.100f", "x", "%",
+		"%.2f%" }) do
+	TEMPLATES.test_sub_format_bad = "$[format=" .. format .. "]{value}"
+	assert(not pcall(template.render, "test_sub_format_bad", { value = 1 }))
+end
+TEMPLATES.test_sub_format_json = "$[J,format=%d]{value}"
+assert(not pcall(template.render, "test_sub_format_json", { value = 1 }))
+
+-- Test joining
+TEMPLATES.test_sub_join = "$[x,join=\", \"]{value}"
+TEMPLATES.test_sub_join_format = "$[join=;,format=%.1f]{value}"
+TEMPLATES.test_sub_join_supnil = "$[n,join=\",\"]{value}"
+test("test_sub_join", { value = { "a", "<b>", 3 } }, "a, &lt;b&gt;, 3")
+test("test_sub_join", { value = { } }, "")
+test("test_sub_join", { value = "<a>" }, "&lt;a&gt;")
+test("test_sub_join_format", { value = { 1, 2.25 } }, "1.0;2.2")
+test("test_sub_join_supnil", { value = setmetatable({ nil, 2, nil },
+		{ __len = function () return 3 end }) }, "2")
+test("test_sub_join_supnil", { value = setmetatable({ 1, nil, 3 },
+		{ __len = function () return 3 end }) }, "1,3")
+test("test_sub_join", { value = setmetatable({ }, { __len = function () return 2 end,
+		__index = function (_, k) return k * 2 end }) }, "2, 4")
+
+-- Test additional escapes
+TEMPLATES.test_sub_css = "$[c]{value}"
+TEMPLATES.test_sub_attr = "$[a]{value}"
+TEMPLATES.test_sub_csv = "$[v]{value}"
+TEMPLATES.test_sub_json_str = "\"$[s]{value}\""
+TEMPLATES.test_sub_json_str_json = "$[Js]{value}"
+test("test_sub_css", { value = "a b;\xc3\xa4" }, "a\\20 b\\3B \xc3\xa4")
+test("test_sub_attr", { value = "a-b, c=\"d\"" }, "a-b,&#x20;c&#x3D;&#x22;d&#x22;")
+test("test_sub_csv", { value = "abc" }, "abc")
+test("test_sub_csv", { value = "a,\"b\"" }, "\"a,\"\"b\"\"\"")
+test("test_sub_csv", { value = 1.5 }, "1.5")
+test("test_sub_json_str", { value = "a\"\1</" }, "\"a\\\"\\u0001<\\/\"")
+test("test_sub_json_str_json", { value = { "a" } }, "[\\\"a\\\"]")
+
+-- Test safe strings
+local safe = template.safe("<b>&amp;</b>")
+assert(tostring(safe) == "<b>&amp;</b>")
+test("test_sub_xml", { xml = safe }, "<b>&amp;</b>")
+test("test_sub_json", { value = safe }, "<b>&amp;</b>")
+test("test_sub_join", { value = { "<", safe } }, "&lt;, <b>&amp;</b>")
+
+-- Test escape cache
+assert(template.getescapecache() == 0)
+template.setescapecache(100)
+assert(template.getescapecache() == 128)
+TEMPLATES.test_sub_cached = "$[x]{a}$[x]{a}$[u]{a}$[x]{b}$[x]{b}"
+test("test_sub_cached", { a = "<a&b>", b = "plain" },
+		"&lt;a&amp;b&gt;&lt;a&amp;b&gt;%3Ca%26b%3Eplainplain")
+test("test_sub_cached", { a = "<a&b>", b = "plain" },
+		"&lt;a&amp;b&gt;&lt;a&amp;b&gt;%3Ca%26b%3Eplainplain")
+test("test_sub_cached", { a = "plain", b = "\"" }, "plainplainplain&quot;&quot;")
+test("test_sub_csv", { value = "a,b" }, "\"a,b\"")
+template.setescapecache(0)
+assert(template.getescapecache() == 0)
+test("test_sub_cached", { a = "<", b = "" }, "&lt;&lt;%3C")
+
+-- Test flushing
+local filename = os.tmpname()
+local function flushed ()
+	local f = assert(io.open(filename))
+	local content = f:read("a")
+	f:close()
+	return content
+end
+TEMPLATES.test_flush = "<head><l:flush/>${flushed()}"
+TEMPLATES.test_flush_after = "<head>${flushed()}"
+file = assert(io.open(filename, "w"))
+template.render("test_flush", setmetatable({ flushed = flushed }, { __index = _G }), file)
+file:close()
+assert(flushed() == "<head>&lt;head&gt;")
+file = assert(io.open(filename, "w"))
+template.render("test_flush_after", setmetatable({ flushed = flushed }, { __index = _G }), file,
+		{ flush = 4 })
+file:close()
+assert(flushed() == "<head>&lt;head&gt;")
+os.remove(filename)
+test("test_flush", { flushed = function () return "" end }, "<head>")
+
+-- Test rope output
+TEMPLATES.test_rope = string.rep("-", 64) .. "${value}" .. string.rep("=", 64) .. "${value}"
+local rope = template.render("test_rope", setmetatable({ value = "<>" }, { __index = _G }), nil,
+		{ rope = true })
+local expected = string.rep("-", 64) .. "&lt;&gt;" .. string.rep("=", 64) .. "&lt;&gt;"
+assert(#rope == #expected)
+assert(rope:tostring() == expected)
+assert(tostring(rope) == expected)
+assert(table.concat(rope:totable()) == expected)
+assert(#rope:totable() == 4)
+assert(select(2, rope:iovecs()) == 4)
+local limited = template.render("test_rope", setmetatable({ value = "" }, { __index = _G }), nil,
+		{ rope = true, max_bytes = 128 })
+assert(#limited == 128 and select(2, limited:iovecs()) == 2)
+assert(not pcall(template.render, "test_rope", setmetatable({ value = "" }, { __index = _G }), nil,
+		{ rope = true, max_bytes = 127 }))
+template.clear()
+collectgarbage()
+assert(rope:tostring() == expected)
+rope, hash = template.render("test_for", setmetatable({ values = { 1, 2, 3 } }, { __index = _G }),
+		nil, { rope = true, hash = true })
+assert(rope:tostring() == "123")
+assert(hash == "3c697d223fa7e885")
+assert(not pcall(template.render, "test_for", { }, io.tmpfile(), { rope = true }))
+
+-- Test raw inclusion
+TEMPLATES.test_rawinclude = "<l:rawinclude filename=\"'test_sub_xml'\"/>"
+test("test_rawinclude", { }, "$[x]{xml}")
+template.setresolver(nil)
+filename = os.tmpname()
+file = assert(io.open(filename, "w"))
+file:write("[<l:rawinclude filename=\"'test/test.txt'\"/>]")
+file:close()
+file = io.tmpfile()
+file:write("<")
+template.render(filename, _G, file)
+file:write(">")
+file:seek("set")
+assert(file:read("a") == "<[Test\n]>")
+file:close()
+assert(template.render(filename, _G) == "[Test\n]")
+file = io.tmpfile()
+hash = template.render(filename, _G, file, { hash = true })
+assert(hash == select(2, template.render(filename, _G, nil, { hash = true })))
+file:seek("set")
+assert(file:read("a") == "[Test\n]")
+file:close()
+file = io.tmpfile()
+template.render(filename, _G, file, { max_bytes = 7 })
+assert(not pcall(template.render, filename, _G, file, { max_bytes = 5 }))
+file:seek("set")
+assert(file:read("a") == "[Test\n]")
+file:close()
+os.remove(filename)
+template.clear()
+template.setresolver(function (key) return TEMPLATES[key] end)
+
+-- Test render limits
+local limit_env = setmetatable({ values = { 1, 2, 3 } }, { __index = _G })
+assert(template.render("test_for", limit_env, nil, { max_bytes = 3 }) == "123")
+assert(select(2, pcall(template.render, "test_for", limit_env, nil, { max_bytes = 2 }))
+		:find("output limit"))
+file = io.tmpfile()
+file:write("head")
+assert(not pcall(template.render, "test_for", limit_env, file, { max_bytes = 2 }))
+file:seek("set")
+assert(file:read("a") == "head")
+file:close()
+filename = os.tmpname()
+file = io.open(filename, "w")
+file:write("0123456789")
+file:close()
+file = io.open(filename, "r+")
+assert(not pcall(template.render, "test_for", limit_env, file, { max_bytes = 2 }))
+assert(file:seek() == 0)
+assert(file:read("a") == "0123456789")
+file:close()
+os.remove(filename)
+limit_env.values = { }
+for i = 1, 10000 do
+	limit_env.values[i] = i
+end
+TEMPLATES.test_slow = "<l:for in=\"ipairs(values)\" names=\"_, value\">${sleep(value)}</l:for>"
+function limit_env.sleep (value)
+	local t = os.clock()
+	while os.clock() - t < 0.0001 do end
+	return value
+end
+local ok, err = pcall(template.render, "test_slow", limit_env, nil, { deadline_ms = 10 })
+assert(not ok and err:find("deadline"))
+
+-- Test differential rendering
+TEMPLATES.test_track = "<h1>${title}</h1><l:set names=\"n\" expressions=\"#items\"/>"
+		.. "<l:for in=\"ipairs(items)\" names=\"_, item\"><li>${item}</li></l:for><p>${n}</p>"
+local track_env = setmetatable({ title = "a", items = { "x" } }, { __index = _G })
+local output, deps = template.render("test_track", track_env, nil, { track = true })
+assert(output == "<h1>a</h1><li>x</li><p>1</p>")
+assert(#deps == 8 and deps[2].title and deps[5].items and not deps[5].title)
+track_env.title = "b"
+local patches = template.render("test_track", track_env, nil, { track = deps,
+		changed = { "title" } })
+assert(#patches == 1 and patches[1].id == 2 and patches[1].html == "b")
+track_env.items = { "y", "z" }
+patches = template.render("test_track", track_env, nil, { track = deps, changed = { "items" } })
+assert(#patches == 2)
+assert(patches[1].id == 5 and patches[1].html == "<li>y</li><li>z</li>")
+assert(patches[2].id == 7 and patches[2].html == "2")
+assert(#template.render("test_track", track_env, nil, { track = deps, changed = { } }) == 0)
+
+-- Test edge-side includes
+TEMPLATES.test_esi = "[<l:include filename=\"'test_if'\" esi=\"true\"/>]"
+test("test_esi", { cond = true }, "[True]")
+assert(template.render("test_esi", { cond = true }, nil, { esi = true })
+		== "[<esi:include src=\"test_if\"/>]")
+assert(template.render("test_esi", { }, nil, { esi = function (name)
+	return "/partials?name=" .. name .. "&v=1"
+end }) == "[<esi:include src=\"/partials?name=test_if&amp;v=1\"/>]")
+assert(template.render("test_include", { cond = true }, nil, { esi = true }) == "include: True")
+
+-- Test datasets
+TEMPLATES.test_dataset = "<l:for in=\"rows\" names=\"row\">${row.name}:$[n]{row.qty}:${row.price};"
+		.. "</l:for>"
+TEMPLATES.test_dataset_index = "<l:for in=\"rows\" names=\"i, row\">${i}=${row.name};</l:for>"
+local dataset = template.dataset({ name = { "a", "b<", "c" }, qty = { 1, nil, 3 },
+		price = { 1.5, 2, 0.25 } })
+assert(#dataset == 3)
+test("test_dataset", { rows = dataset }, "a:1:1.5;b&lt;::2.0;c:3:0.25;")
+test("test_dataset_index", { rows = dataset }, "1=a;2=b&lt;;3=c;")
+TEMPLATES.test_dataset_lookup = "<l:for in=\"rows\" names=\"row\">${row.name}${row.name}$[n]{row.x}"
+		.. "$[n]{row[1]}${row.name};</l:for>"
+test("test_dataset_lookup", { rows = dataset }, "aaa;b&lt;b&lt;b&lt;;ccc;")
+test("test_dataset_lookup", { rows = dataset }, "aaa;b&lt;b&lt;b&lt;;ccc;")
+test("test_for", { values = { 1, 2 } }, "12")
+assert(not pcall(template.dataset, { x = { 1, "a" } }))
+filename = os.tmpname()
+file = assert(io.open(filename, "w"))
+file:write("name;qty;price\r\na;1;1.5\n\nb<;;2\nc;3\n")
+file:close()
+dataset = template.dataset(filename, ";")
+os.remove(filename)
+assert(#dataset == 3)
+test("test_dataset", { rows = dataset }, "a:1:1.5;b&lt;::2.0;c:3:(nil);")
+test("test_dataset", { rows = template.dataset({ }) }, "")
+filename = os.tmpname()
+file = assert(io.open(filename, "w"))
+file:write("name,qty,price\n9223372036854775808,  12,inf\n0x10,12,nan\n-1e400,-7,1e3\n")
+file:close()
+dataset = template.dataset(filename)
+os.remove(filename)
+test("test_dataset", { rows = dataset }, "9223372036854775808:  12:inf;0x10:12:nan;-1e400:-7:1e3;")
+
+-- Test registered sources
+template.setsources({ test_source = "source: ${value}", test_source_raw = "<raw>" })
+template.clear()
+test("test_source", { value = 1 }, "source: 1")
+TEMPLATES.test_source_include = "<l:include filename=\"'test_source'\"/>"
+		.. "<l:rawinclude filename=\"'test_source_raw'\"/>"
+test("test_source_include", { value = 2 }, "source: 2<raw>")
+test("test_if", { cond = true }, "True")
+assert(not pcall(template.setsources, { test_source = 1 }))
+template.setsources(nil)
+template.clear()
+assert(not pcall(template.render, "test_source", { }))
+
+-- Test archives
+local function tar (members)
+	local blocks = { }
+	for _, member in ipairs(members) do
+		local name, content = member[1], member[2]
+		local header = name .. string.rep("\0", 100 - #name) .. "0000644\0" .. "0000000\0"
+				.. "0000000\0" .. string.format("%011o\0", #content) .. "00000000000\0"
+				.. "        " .. (member.type or "0") .. string.rep("\0", 100)
+				.. (member.magic or "ustar\0" .. "00") .. string.rep("\0", 80)
+				.. (member.prefix or "")
+		header = header .. string.rep("\0", 512 - #header)
+		local sum = 0
+		for i = 1, #header do
+			sum = sum + header:byte(i)
+		end
+		header = header:sub(1, 148) .. string.format("%06o\0 ", sum) .. header:sub(157)
+		blocks[#blocks + 1] = header .. content .. string.rep("\0", -#content % 512)
+	end
+	return table.concat(blocks) .. string.rep("\0", 1024)
+end
+filename = os.tmpname()
+file = assert(io.open(filename, "wb"))
+file:write(tar({ { "./test_archive", "archive: ${value}" },
+		{ "test_archive_raw", "<raw>" .. string.rep("x", 600) } }))
+file:close()
+template.setarchive(filename)
+os.remove(filename)
+template.clear()
+TEMPLATES.test_archive_include = "<l:include filename=\"'test_archive'\"/>"
+		.. "<l:rawinclude filename=\"'test_archive_raw'\"/>"
+test("test_archive", { value = 1 }, "archive: 1")
+test("test_archive_include", { value = 2 }, "archive: 2<raw>" .. string.rep("x", 600))
+template.setarchive(nil)
+local long_name = string.rep("d/", 60) .. "test_archive_long"
+local pax_path = "path=" .. long_name .. "\n"
+pax_path = string.format("%d %s", #pax_path + 4, pax_path)
+filename = os.tmpname()
+file = assert(io.open(filename, "wb"))
+file:write(tar({ { "././@LongLink", long_name .. "\0", type = "L" },
+		{ "truncated", "gnu: ${value}" },
+		{ "pax", "14 mtime=1.25\n" .. pax_path, type = "x" },
+		{ "truncated", "pax: ${value}" },
+		{ "test_archive_prefix", "prefix: ${value}", magic = "ustar  \0", prefix = "\1\2\3" },
+		{ "test_archive_posix", "posix: ${value}", prefix = "d" } }))
+file:close()
+template.setarchive(filename)
+os.remove(filename)
+template.clear()
+TEMPLATES.test_archive_long = "<l:rawinclude filename=\"'" .. long_name .. "'\"/>"
+test("test_archive_long", { }, "pax: ${value}")
+TEMPLATES.test_archive_magic = "<l:rawinclude filename=\"'test_archive_prefix'\"/>"
+		.. "<l:rawinclude filename=\"'d/test_archive_posix'\"/>"
+test("test_archive_magic", { }, "prefix: ${value}posix: ${value}")
+test("test_if", { cond = true }, "True")
+template.setarchive(nil)
+template.clear()
+assert(not pcall(template.render, "test_archive", { }))
+
+-- Test batch resolver
+local batches = { }
+template.setresolver(function (filenames)
+	local sources = { }
+	batches[#batches + 1] = table.concat(filenames, ",")
+	for _, filename in ipairs(filenames) do
+		sources[filename] = TEMPLATES[filename]
+	end
+	return sources
+end, { batch = true })
+local resolver, options = template.getresolver()
+assert(options.batch == true)
+template.setresolver(resolver, options)
+template.clear()
+TEMPLATES.test_batch = "<l:include filename=\"'test_batch_a'\"/>"
+		.. "<l:include filename=\"'test_batch_b'\"/><l:include filename=\"name\"/>"
+TEMPLATES.test_batch_a = "a<l:include filename=\"'test_batch_b'\"/>"
+TEMPLATES.test_batch_b = "b<l:include filename=\" 'test_batch_c' \"/>"
+TEMPLATES.test_batch_c = "c"
+test("test_batch", { name = "test_if", cond = true }, "abcbcTrue")
+assert(#batches == 4)
+assert(batches[1] == "test_batch")
+assert(batches[2] == "test_batch_a,test_batch_b")
+assert(batches[3] == "test_batch_c")
+assert(batches[4] == "test_if")
+test("test_batch", { name = "test_if", cond = false }, "abcbc")
+assert(#batches == 4)
+template.setresolver(function (key) return TEMPLATES[key] end)
+template.clear()
+
+-- Test message catalogs
+template.setcatalog("en", { ["checkout.title"] = "Check out", greeting = "Hello <you>" })
+template.setcatalog("de", { ["checkout.title"] = "Zur Kasse" })
+TEMPLATES.test_message = "<l:t key=\"'checkout.title'\"/>|<l:t key=\"'greeting'\"/>|$[t]{key}"
+		.. "|$[tu]{'greeting'}"
+test("test_message", { key = "greeting" }, "checkout.title|greeting|greeting|greeting")
+assert(template.render("test_message", { key = "checkout.title" }, nil, { locale = "en" })
+		== "Check out|Hello &lt;you&gt;|Check out|Hello%20%3Cyou%3E")
+assert(template.render("test_message", { key = "greeting" }, nil, { locale = "de" })
+		== "Zur Kasse|greeting|greeting|greeting")
+assert(not pcall(template.render, "test_message", { key = "x" }, nil, { locale = "fr" }))
+template.setcatalog("fr", { greeting = "Bonjour" })
+assert(template.render("test_message", { key = "greeting" }, nil, { locale = "fr" })
+		== "checkout.title|Bonjour|Bonjour|Bonjour")
+template.setcatalog("de", nil)
+assert(not pcall(template.render, "test_message", { key = "x" }, nil, { locale = "de" }))
+assert(not pcall(template.setcatalog, "de", { greeting = 1 }))
+TEMPLATES.test_message_nil = "[$[tn]{key}|$[t]{key}]"
+assert(template.render("test_message_nil", { }, nil, { locale = "fr" }) == "[|(nil)]")
+TEMPLATES.test_message_bad = "$[tJ]{'greeting'}"
+assert(not pcall(template.render, "test_message_bad", { }))
+
+-- Test variables
+local function keys (set)
+	local list = { }
+	for key in pairs(set) do
+		list[#list + 1] = key
+	end
+	table.sort(list)
+	return table.concat(list, ",")
+end
+TEMPLATES.test_variables = "<l:for names=\"_, item\" in=\"ipairs(items)\">${item.name:upper()}"
+		.. "$[x,format=%d]{ count + 1 }</l:for><l:set names=\"total\" expressions=\"#items\"/>"
+		.. "${string.format('%s [[x]] %d', title, ({ size = 1 }).size)}--[[ ignored ]]"
+		.. "<l:include filename=\"'test_variables_include'\"/>"
+TEMPLATES.test_variables_include = "<l:if cond=\"user and user.admin --comment\">"
+		.. "${f(function (arg, ...) return arg end, arg2)}</l:if><l:include filename=\"name\"/>"
+		.. "${g(function (y) if y then return y end return z end, y)}"
+local reads, writes, complete = template.variables("test_variables")
+assert(keys(reads) == "arg2,count,f,g,ipairs,item,items,name,string,title,user,y,z")
+assert(keys(writes) == "_,item,total")
+assert(complete == false)
+reads, writes, complete = template.variables("test_if")
+assert(keys(reads) == "cond")
+assert(keys(writes) == "")
+assert(complete == true)
+
+-- Test new environments
+local base = { items = { { name = "a" } }, count = 1, string = string, ipairs = ipairs }
+local env = template.newenv("test_variables", base)
+assert(next(env) == nil)
+assert(getmetatable(env).__index == base)
+assert(getmetatable(template.newenv("test_variables", base)) == getmetatable(env))
+assert(getmetatable(template.newenv("test_if")) == nil)
+env.cond = true
+assert(template.render("test_if", env) == "True")
+
+-- Test escape functions
+assert(template.escape("<a href=\"x\">&'") == "&lt;a href=&quot;x&quot;&gt;&amp;&apos;")
+assert(template.escape("a b/ü", "u") == "a%20b%2F%C3%BC")
+assert(template.escape("a,\"b\"", "v") == "\"a,\"\"b\"\"\"")
+assert(template.escape("</script>\n", "s") == "<\\/script>\\n")
+assert(template.escape("it's", "j") == "it\\'s")
+assert(template.escape(42) == "42")
+assert(template.escape("") == "")
+assert(template.escape(string.rep("a<", 10000)) == string.rep("a&lt;", 10000))
+assert(not pcall(template.escape, "x", "q"))
+local values = { "<b>", "plain", 7, "a&b" }
+assert(template.escapeall(values) == values)
+assert(values[1] == "&lt;b&gt;" and values[2] == "plain" and values[3] == 7
+		and values[4] == "a&amp;b")
+template.escapeall(values, "u")
+assert(values[1] == "%26lt%3Bb%26gt%3B")